@@ -17,6 +17,13 @@
     uint8_t _numlines;
     uint8_t _currline;
 
+// delay loop count (4 CPU cycles each) for clear and home, 2 ms at 16 MHz, see ST7032SetClockShift()
+static uint16_t ST7032LongDelay = F_CPU / 4000000UL * 2000;
+
+void ST7032SetClockShift(uint8_t shift) {
+  ST7032LongDelay = (F_CPU / 4000000UL * 2000) >> shift;
+}
+
 // private methods
 
 void setDisplayControl(uint8_t setBit) {
@@ -110,13 +117,13 @@ void ST7032setIcon(uint8_t addr, uint8_t bit) {
 void ST7032clear(void)
 {
 	command(LCD_CLEARDISPLAY);  // clear display, set cursor position to zero
-	_delay_us(2000);  // this command takes a long time!
+	_delay_loop_2(ST7032LongDelay);  // this command takes a long time!
 }
 
 void ST7032home(void)
 {
 	command(LCD_RETURNHOME);  // set cursor position to zero
-	_delay_us(2000);  // this command takes a long time!
+	_delay_loop_2(ST7032LongDelay);  // this command takes a long time!
 }
 
 void ST7032setCursor(uint8_t col, uint8_t row)
@@ -100,6 +100,9 @@
     void ST7032clear(void);
     void ST7032home(void);
 
+    // adapt the waits of clear and home to a CPU clock of F_CPU >> shift, 0 for F_CPU
+    void ST7032SetClockShift(uint8_t shift);
+
     void ST7032noDisplay(void);
     void ST7032display(void);
     void ST7032noBlink(void);
@@ -12,8 +12,19 @@
 //#define H_DEL _delay_loop_2(5)
 //#define Q_DEL _delay_loop_2(5)
 //#define H_DEL _delay_loop_2(20)
-#define Q_DEL _delay_loop_2(15)
-#define H_DEL _delay_loop_2(60)
+#define Q_DEL _delay_loop_2(SoftI2CQuarterDelay)
+#define H_DEL _delay_loop_2(SoftI2CHalfDelay)
+
+// delay loop counts (4 CPU cycles each) for 16 MHz, see SoftI2CSetClockShift()
+static uint16_t SoftI2CQuarterDelay = 15;
+static uint16_t SoftI2CHalfDelay = 60;
+
+
+void SoftI2CSetClockShift(uint8_t shift) {
+	// keep at least one loop, a count of 0 means 65536
+	SoftI2CQuarterDelay = (15 >> shift) ? (15 >> shift) : 1;
+	SoftI2CHalfDelay = (60 >> shift) ? (60 >> shift) : 1;
+}
 
 
 void SoftI2CInit(void) {
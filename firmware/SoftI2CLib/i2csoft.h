@@ -115,4 +115,21 @@ Returns:
 uint8_t SoftI2CReadByte(uint8_t ack);
 
 
+/**********************************************************
+SoftI2CSetClockShift()
+
+Description:
+	Adapts the bus delays to a CPU clock of F_CPU >> shift,
+	so the bus keeps its speed when the clock is reduced.
+	
+Arguments:
+	shift: 0 for F_CPU
+	
+Returns:
+	Nothing
+
+**********************************************************/
+void SoftI2CSetClockShift(uint8_t shift);
+
+
 #endif
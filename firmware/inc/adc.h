@@ -42,10 +42,22 @@
     #error "Reduce F_CPU to keep the ADC-clock below 200kHz."
 #endif
 #define ADC_CLOCK               (F_CPU / ADC_PRESCALER)
+
+// prescaler at the reduced CPU clock F_CPU / 8 of clock_slow(): 62.5 kHz. The ADC clock stays within the range of the
+// manual and a conversion takes 416 CPU cycles, which leaves the CPU time between the ADC interrupts of the scan.
+#define ADC_PRESCALER_SLOW_REG  (1 << ADPS2 | 1 << ADPS0)
 #define ADC_REFVOLTAGE_AREF     0 // [mV] external reference voltage
 #define ADC_REFVOLTAGE_INT      1100 // [mV]
 #define ADC_REFVOLTAGE_AVCC     5000 // [mV]
 
+/*
+ * Let the CPU sleep in ADC noise reduction mode during conversions instead of busy-waiting on ADSC.
+ * This lowers digital noise coupled into the converter and the active current. ADC noise reduction mode halts
+ * clk_IO, i.e. timer0 (buck PWM) and timer1 (time base), so it is only used while the buck PWM is stopped.
+ * Comment out to benchmark against the busy-wait path.
+ */
+// #define ADC_NOISE_REDUCTION
+
 
 typedef enum
 {
@@ -90,6 +102,7 @@ typedef enum
 
 
 void adc_init(adc_voltageReference, adc_adjustResult, adc_interrupt, adc_autoTrigger, adc_autoTriggerSource);
+void adc_setPrescaler(uint8_t prescalerReg);
 
 
 static inline void adc_setChannel(uint8_t channel)
@@ -122,9 +135,77 @@ static inline void adc_disable(void)
  * disable power to analog comparator
  */
 void analog_comparator_disable(void);
+void analog_comparator_enableWake(uint8_t channel);
+uint8_t analog_comparator_isTriggered(void);
 
 uint16_t adc_singleConversion(void);
 uint16_t adc_12BitConversion(uint8_t channel);
 
-#endif
 
+/*
+ * Background scan engine.
+ * ADC_vect converts the channels of a descriptor table. Each channel has its own period: a scan round visits every
+ * channel that is due in this round and takes a burst of samples from it, so slow channels (temperatures) do not
+ * take ADC time away from the control-relevant ones (currents, voltages).
+ * Every raw sample is fed into a per-channel exponential moving average
+ *     filter += sample - filter / 2^shift
+ * which holds the average scaled by 2^shift. Its time constant is 2^shift samples of the channel, i.e.
+ * 2^shift / samples visits. The filter state is kept across visits and the 12 bit result is filter / 2^(shift - 2),
+ * so a fresh filtered value is available after every sample.
+ * The main loop only reads the latest values and never waits for a conversion.
+ * adc_init() must be called with adc_interruptEnabled.
+ */
+#define ADC_SCAN_CHANNELS_MAX   8
+#define ADC_SCAN_SHIFT_MIN      2  // 12 bit results need a filter state of at least 10 + 2 bit
+#define ADC_SCAN_SHIFT_MAX      6  // 1023 * 64 still fits into uint16_t
+
+typedef struct
+{
+    uint8_t channel;    // multiplexer channel, see adc_setChannel()
+    uint8_t samples;    // samples per visit, 1..255
+    uint8_t shift;      // log2 of the filter time constant in samples, ADC_SCAN_SHIFT_MIN..ADC_SCAN_SHIFT_MAX
+    uint8_t period;     // [scan rounds] visit in every period-th round, 1..255
+    uint8_t sync;       // non-zero: start the conversions at a fixed phase of the timer0 PWM, see below
+} adc_scanChannel;
+
+/*
+ * PWM synchronized sampling.
+ * Conversions of channels with the sync flag are started at a fixed phase of the timer0 buck PWM instead of at
+ * random points of the switching ripple. The trigger is Timer1 Compare Match B: timer1 runs from the undivided
+ * system clock like timer0 and its period (TIME_TIMER1_OCR1A + 1) is a multiple of the PWM period, so OCR1B can be
+ * placed at any phase of the PWM. This needs adc_init() with adc_autoTriggerEnabled and
+ * adc_autoTriggerSourceTimer1CompareB. While timer0 is stopped or prescaled, all channels are converted unsynchronized.
+ */
+// In auto trigger mode sample and hold takes place two ADC clock cycles plus three CPU cycles after the trigger.
+#define ADC_SYNC_DELAY          (2 * ADC_PRESCALER + 3) // [CPU cycles]
+
+typedef enum
+{
+    adc_syncPhaseMidOn      = 0, // sample in the middle of the on-time of the 0° stage (OC0B high)
+    adc_syncPhaseMidOff     = 1  // sample in the middle of the off-time of the 0° stage
+} adc_syncPhase;
+
+/*
+ * Limit watch.
+ * Every single raw 10 bit sample of a channel with a limit is compared against it before it enters the filter. If it
+ * is above the limit, the handler is called right from ADC_vect with the table position of the channel, so it has to
+ * be short and must not enable interrupts. The reaction time is one conversion (104 us) plus the time until the
+ * channel is visited again, plus any time the interrupts are disabled elsewhere (e.g. the display output in hmi.c).
+ * adc_scanInit() removes all limits.
+ */
+#define ADC_SCAN_LIMIT_NONE     UINT16_MAX
+
+typedef void (*adc_scanLimitHandler)(uint8_t index);
+
+void adc_scanInit(const adc_scanChannel *table, uint8_t count);
+void adc_scanSetLimit(uint8_t index, uint16_t limit);
+void adc_scanSetLimitHandler(adc_scanLimitHandler handler);
+void adc_scanSetSyncPhase(adc_syncPhase phase);
+void adc_scanStart(void);
+void adc_scanStop(void);
+void adc_scanWait(void);
+uint8_t adc_scanGetCycle(void);
+uint8_t adc_scanGetUpdated(void);
+uint16_t adc_scanGetResult(uint8_t index);
+
+#endif
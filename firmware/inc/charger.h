@@ -42,6 +42,7 @@ typedef struct {
     uint16_t charge_panel_current_min; // [mA] is the minimum solar panel current to continue charging.
     uint8_t restart_charging_time; // [s]	is the time between
     uint16_t mppt_panel_current_min;	// [mA] is the minimum panel current needed to do MPPT.
+    mppt_algorithm_t mppt_algorithm;	// MPP tracker, see mppt_algorithm_t
 } ChargingProfile;
 
 // possible charger states
@@ -94,6 +95,11 @@ uint8_t isOvertemperature1(void);
 
 uint8_t isOvertemperature2(void);
 
+/** returns non-zero while the fast trip has latched an overcurrent or overvoltage fault
+ *
+ */
+uint8_t isFault(void);
+
 
 /** guess a pwm start value from given panel- and battery voltages,
  * switch on the buck converters and
@@ -102,6 +108,33 @@ uint8_t isOvertemperature2(void);
  */
 void startCharging(void);
 
+/** switch the buck stages between minimal, 125 kHz and 62.5 kHz depending on the panel current,
+ * with the hysteresis of the PANEL_CURRENT_*_F_UP/DOWN thresholds
+ *
+ */
+void charger_selectFrequency(const measurements_t * measurements);
+
+/** switch the 180° buck stage on or off depending on the panel current,
+ * with hysteresis between PANEL_CURRENT_SHTDN_180DEG and PANEL_CURRENT_ACTIVATE_180DEG
+ *
+ */
+void charger_shedPhases(const measurements_t * measurements);
+
+/** stop continuous switching at light load: from now on charger_burst() runs the 0° stage in bursts
+ *
+ */
+void charger_startBurst(void);
+
+/** returns non-zero while burst mode is active, the MPP tracker holds still meanwhile
+ *
+ */
+uint8_t charger_isBursting(void);
+
+/** burst mode state machine, call on every fresh measurement while charging
+ *
+ */
+void charger_burst(const measurements_t * measurements);
+
 /** stop the buck converters
  *  update charger status flag and
  *  reset the datetime to 0s
@@ -143,7 +176,7 @@ uint8_t charger_discharging_enabled(void);
  *  @param battery_voltage Actual measured battery voltage (V)
  *  @param battery_current Actual measured battery current (A)
  */
-void charger_update(measurements_t * measurements);
+void charger_update(const measurements_t * measurements);
 
 /** Get current charge controller state
  *
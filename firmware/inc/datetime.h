@@ -48,6 +48,8 @@ void datetime_init(void);
 void datetime_set(uint32_t seconds);
 uint32_t datetime_getS(void);
 uint16_t datetime_getMs(void);
+uint16_t datetime_getTick(void);
+void datetime_setClockShift(uint8_t shift);
 float datetime_getAsFloat(void);
 void datetime_timestamp2datetime(uint32_t timestamp, datetime_t *datetime);
 char* datetime_nowToS(char* dst);
@@ -7,6 +7,7 @@
 #define _LINEARIZE_H__
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
 
 /*
@@ -16,10 +17,44 @@ Interpolate an output value for a given input value using a calibrated table.
 */
 
 
+/*
+The tables live in flash (PROGMEM) and are read with pgm_read_*(). Every point stores the gradient of the segment
+that ends at it, scaled by 1024, so linearizeU16() needs no division. Define a table with
+    LINEARIZATION_TABLE(number of points, adc0, value0, adc1, value1, ...)
+which lists every calibration point once; the compiler derives each gradient from the point and its predecessor.
+The first point has no segment of its own. A wrong number of points does not compile.
+*/
+#define LINEARIZATION_GRADIENT(adc0, value0, adc1, value1)  ((uint32_t)((value1) - (value0)) * 1024 / ((adc1) - (adc0)))
+#define LINEARIZATION_FIRST(adc0, value0)                   {(adc0), (value0), 0}
+#define LINEARIZATION_POINT(adc0, value0, adc1, value1)     {(adc1), (value1), \
+                                                             LINEARIZATION_GRADIENT(adc0, value0, adc1, value1)}
+
+// LINEARIZATION_POINTS_n expands n points into the table entries, each step adds the segment to the next point
+#define LINEARIZATION_POINTS_2(a0, v0, a1, v1) \
+    LINEARIZATION_FIRST(a0, v0), LINEARIZATION_POINT(a0, v0, a1, v1)
+#define LINEARIZATION_POINTS_3(a0, v0, a1, v1, a2, v2) \
+    LINEARIZATION_POINTS_2(a0, v0, a1, v1), LINEARIZATION_POINT(a1, v1, a2, v2)
+#define LINEARIZATION_POINTS_4(a0, v0, a1, v1, a2, v2, a3, v3) \
+    LINEARIZATION_POINTS_3(a0, v0, a1, v1, a2, v2), LINEARIZATION_POINT(a2, v2, a3, v3)
+#define LINEARIZATION_POINTS_5(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4) \
+    LINEARIZATION_POINTS_4(a0, v0, a1, v1, a2, v2, a3, v3), LINEARIZATION_POINT(a3, v3, a4, v4)
+#define LINEARIZATION_POINTS_6(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5) \
+    LINEARIZATION_POINTS_5(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4), LINEARIZATION_POINT(a4, v4, a5, v5)
+#define LINEARIZATION_POINTS_7(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5, a6, v6) \
+    LINEARIZATION_POINTS_6(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5), LINEARIZATION_POINT(a5, v5, a6, v6)
+#define LINEARIZATION_POINTS_8(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5, a6, v6, a7, v7) \
+    LINEARIZATION_POINTS_7(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5, a6, v6), LINEARIZATION_POINT(a6, v6, a7, v7)
+#define LINEARIZATION_POINTS_9(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5, a6, v6, a7, v7, a8, v8) \
+    LINEARIZATION_POINTS_8(a0, v0, a1, v1, a2, v2, a3, v3, a4, v4, a5, v5, a6, v6, a7, v7), LINEARIZATION_POINT(a7, v7, a8, v8)
+
+#define LINEARIZATION_TABLE(size, ...)                      {(size), {LINEARIZATION_POINTS_##size(__VA_ARGS__)}}
+
+
 typedef struct
 {
     uint16_t adc;
     uint16_t value;
+    uint32_t gradient;  // (value - previous value) * 1024 / (adc - previous adc)
 } linearizationPointU16_t;
 
 
@@ -26,11 +26,25 @@
 #define TEMP2_FAN_ON        27315UL + 60 * 100
 #define TEMP2_FAN_OFF       27315UL + 50 * 100
 
+// Fast overcurrent/overvoltage trip: ADC_vect compares every single sample of the charge current and battery voltage
+// against these limits and shuts down both buck stages at once. The display writes in hmi.c run with interrupts
+// disabled and delay the trip by up to their duration. Comment out to rely on the control loop only.
+#define PROTECTION_FAST_TRIP
+#define PROTECTION_CHARGE_CURRENT_ADC   1002 // [10 bit ADC counts] approx. 10.2 A, see linListChargeCurrent
+#define PROTECTION_BATTERY_VOLTAGE_ADC  960  // [10 bit ADC counts] approx. 15.0 V, see linListBattVoltage
+
+
+// Task rates of the scheduler, see the task table in main.c. The MPP tracker interval has to leave the buck
+// converter and the ADC filters (approx. 7 ms) time to settle after a duty cycle step.
+#define MPPT_UPDATE_INTERVAL_MS         40   // [ms] 25 Hz
+#define CHARGER_UPDATE_INTERVAL_MS      1000 // [ms] the charger state machine counts in seconds
+#define THERMAL_UPDATE_INTERVAL_MS      250  // [ms] overtemperature detection and fan
+#define HMI_UPDATE_INTERVAL_MS          500  // [ms] display refresh
+#define TELEMETRY_UPDATE_INTERVAL_MS    1000 // [ms] see TELEMETRY_UART in main.c
+
 
 //#define CHARGE_PANEL_CURRENT_MIN        20 // [mA]
 
-// TODO: On the fly switching not implemented, yet!
-#define MPPT_CURRENT_MIN                200 // TODO: Replace by switching between PANEL_CURRENT_MINIMAL_F_UP and PANEL_CURRENT_NORMAL_F_DOWN!
 #define PANEL_CURRENT_ACTIVATE_180DEG	525 // [mA] activate 180°-phase power stage when panel current exceeds this value
 #define PANEL_CURRENT_SHTDN_180DEG		475 // [mA] shut down 180°-phase power stage when panel current is below this value
 // Efficiency depends on available current. In minimum frequency mode we do not use MPPT
@@ -39,17 +53,36 @@
 #define PANEL_CURRENT_NORMAL_F_UP       5850 // [mA] normal -> high (62.5 kHz)
 #define PANEL_CURRENT_HIGH_F_DOWN       5300 // [mA] high -> normal (125 kHz)
 
+// Burst mode below charge_panel_current_min: the 0° stage is off while the panel charges its input capacitors up to
+// the estimated MPP voltage + BURST_VOLTAGE_HYSTERESIS, then it runs at 125 kHz until the panel voltage fell to the
+// MPP voltage - BURST_VOLTAGE_HYSTERESIS. On average the panel works at its MPP.
+#define BURST_VOLTAGE_HYSTERESIS        300  // [mV]
+#define BURST_ON_MAX_MS                 200  // [ms] the panel supplies a longer burst: leave burst mode, track again
+#define BURST_PAUSE_MAX_MS              10000 // [ms] the panel does not reach the upper threshold: stop charging
+
 typedef enum
 {
     chargerStatus_idle              = 0,
     chargerStatus_charging          = 1 << 0,
     chargerStatus_full              = 1 << 1, // use tickle charging when full
     chargerStatus_loadConnected     = 1 << 2,
+    chargerStatus_overcurrent       = 1 << 3, // latched by the fast trip, cleared by startCharging()
+    chargerStatus_overvoltage       = 1 << 4, // latched by the fast trip, cleared by startCharging()
     chargerStatus_overtemperature1  = 1 << 5,
     chargerStatus_overtemperature2  = 1 << 6
 } chargerStatus_t;
 
 
+typedef enum
+{
+    mppt_algorithmPerturbObserve            = 0, // hill climbing with variable step
+    mppt_algorithmIncrementalConductance    = 1  // compares dI/dV against -I/V, holds the duty cycle at the MPP
+} mppt_algorithm_t;
+
+// tracker used by profile_init(), may be changed at runtime in ChargingProfile.mppt_algorithm
+#define MPPT_ALGORITHM_DEFAULT  mppt_algorithmPerturbObserve
+
+
 typedef enum
 {
     mppt_direction_none,
@@ -9,22 +9,31 @@
 #include <stdint.h>
 
 
-// Use these variables the calculate averages.
-#define ADCAVG_SAMPLES 4   // the use of power of two turns division into fast shift operation
-#define ADCAVG_MAX     4092 // supersampled 12 bit values
-#if (ADCAVG_SAMPLES > UINT8_MAX)
-    #error "ADC averaging: Numer of samples is too high."
-#endif
+// position of each measured value in the channel list of the background ADC scan
+typedef enum
+{
+    measurement_PTCsupply       = 0, // ADC0
+    measurement_panelCurrent    = 1, // ADC1
+    measurement_panelVoltage    = 2, // ADC2
+    measurement_batteryVoltage  = 3, // ADC4
+    measurement_chargeCurrent   = 4, // ADC5
+    measurement_temperature1    = 5, // ADC6
+    measurement_temperature2    = 6, // ADC7
+    measurement_count           = 7
+} measurement_channel_t;
 
-#if (ADCAVG_SAMPLES * ADCAVG_MAX > UINT32_MAX)
-    #error "ADC averaging: uint32 cannot hold samples*max."
-    #define ADCAVG_SUM_TYPE uint32_t
-#elif (ADCAVG_SAMPLES * ADCAVG_MAX > UINT16_MAX)
-    #define ADCAVG_SUM_TYPE uint32_t
-#else 
-    #define ADCAVG_SUM_TYPE uint16_t
-#endif
 
+/*
+ * Zero offsets of the INA168 current sense amplifiers and the ADC, learned by measurement_autoZero() and
+ * subtracted from the 12 bit results before linearization.
+ */
+#define MEASUREMENT_CHARGE_CURRENT_OFFSET_DEFAULT   16  // [12 bit counts] approx. 40 mA, used until learned
+#define MEASUREMENT_PANEL_CURRENT_OFFSET_DEFAULT    0   // [12 bit counts]
+#define MEASUREMENT_OFFSET_MAX                      100 // [12 bit counts] larger readings are not plausible as zero
+#define MEASUREMENT_AUTOZERO_ROUNDS                 8   // scan rounds to let the filters settle (4 time constants)
+
+// time the derived values on the target, see measurement_profile.h
+//#define MEASUREMENT_PROFILE
 
 
 typedef struct
@@ -49,9 +58,39 @@ typedef struct
 } measurements_t;
 
 
-extern measurements_t measurements;
+/*
+ * learn the zero offsets of the panel and charge current channels. Call only while both buck stages are disabled
+ * and interrupts are enabled; waits MEASUREMENT_AUTOZERO_ROUNDS scan rounds (approx. 30 ms).
+ * returns 1 if the readings were plausible and have been averaged into the offsets, 0 else.
+ */
+uint8_t measurement_autoZero(void);
+
+/*
+ * returns the latest complete set of measurements. measure() publishes a new set by switching between two buffers,
+ * so the returned set never mixes old and new values and stays unchanged until the next but one call of measure().
+ */
+const measurements_t* measurement_getSnapshot(void);
+
+/*
+ * returns a counter that advances whenever measure() published a new set of measurements.
+ */
+uint8_t measurement_getSequence(void);
+
+/*
+ * hand the channel descriptors to the background ADC scan and start it.
+ */
+void measurement_init(void);
+
+/*
+ * update the measurements whose ADC channels got new results. Does not wait for the ADC.
+ * returns the channels that were updated since the last call (bit n = measurement_channel_t n), 0 if none.
+ */
+uint8_t measure(void);
 
-void measure(void);
+/*
+ * compute panel power, charge power and efficiency of a set from its voltages and currents.
+ */
+void measurement_derive(measurements_t *m);
 
 #endif
 
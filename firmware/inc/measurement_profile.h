@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2023 2023 Dipl.-Ing. Jochen Menzel (Jehdar@gmx.de)
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _MEASUREMENT_PROFILE_H__
+#define _MEASUREMENT_PROFILE_H__
+
+#include <stdint.h>
+#include "measurement.h"
+
+/*
+ * Cycle count of the derived values, only built with MEASUREMENT_PROFILE (measurement.h). measure() hands every new
+ * set to measurement_profile(), which times measurement_derive() and the former uint64_t/division based computation
+ * on copies of it with timer1 (CPU clock) and interrupts disabled. The telemetry line reports both counts.
+ */
+
+void measurement_profile(const measurements_t *m);
+
+/*
+ * returns the CPU cycles of the last measurement_profile() call: fixed-point in *fixedPoint, the former 64 bit
+ * version in *reference.
+ */
+void measurement_getCycles(uint16_t *fixedPoint, uint16_t *reference);
+
+#endif
@@ -14,7 +14,77 @@
 
 #include "measurement.h"
 #include "charger.h"
+#include "pwm.h"
 
-void update_mppt(measurements_t * measurements, ChargingProfile * profile);
+/*
+ * Variable step perturb and observe: the duty cycle step follows the slope of the power curve, |dP| / |dD| of the
+ * last step, divided by MPPT_STEP_SCALE. Far from the MPP the slope is steep and the tracker moves fast, near the
+ * peak the slope flattens and the step shrinks down to MPPT_STEP_MIN. Steps are fine (dithered) pwm steps.
+ */
+#define MPPT_STEP_MIN       1           // [fine pwm steps]
+#define MPPT_STEP_MAX       PWM_FINE(8) // [fine pwm steps] limits the perturbation after irradiance jumps
+#define MPPT_STEP_SCALE     8           // [W * 100 per pwm count] slope that results in a step of one pwm count
+
+/*
+ * Incremental conductance: dP/dV = I + V * dI/dV is zero at the MPP. The sign of I * dV + V * dI (times the sign
+ * of dV) tells on which side of the MPP the panel operates. Within the tolerance the duty cycle is held. Changes
+ * below the dead bands are treated as measurement noise.
+ */
+#define MPPT_INC_COND_DV_MIN            50  // [mV] smaller panel voltage changes count as no change
+#define MPPT_INC_COND_DI_MIN            10  // [mA] smaller panel current changes count as no change
+#define MPPT_INC_COND_TOLERANCE_SHIFT   3   // hold if |dI/dV + I/V| < (I/V) / 2^shift
+
+/*
+ * Global sweep: under partial shading the P-V curve has several local maxima and the trackers above stay on the one
+ * they started on. Every MPPT_SWEEP_INTERVAL_S, after a sudden power drop or on mppt_requestSweep() the duty cycle is
+ * swept from pwm_min (the Voc end, no current) upwards in up to MPPT_SWEEP_POINTS steps, one step per update_mppt()
+ * call, and the panel power of every step is recorded. The sweep ends early at the first point that reaches the target voltage or current of
+ * the charger, that point is not used. Then the duty cycle jumps to the best point and fine tracking resumes. The
+ * sweep is aborted at once if the regulator or an overtemperature requires less current. The low current points at
+ * the start do not trigger burst mode. A full sweep takes MPPT_SWEEP_POINTS * MPPT_UPDATE_INTERVAL_MS, approx. 1.3 s
+ * at 40 ms.
+ */
+#define MPPT_SWEEP_INTERVAL_S   600 // [s] time between scheduled sweeps while charging, 0 disables them
+#define MPPT_SWEEP_POINTS       32  // size of the curve buffer, i.e. maximum number of duty cycles visited
+// a drop of the panel power by more than 1 / 2^MPPT_SWEEP_DROP_SHIFT between two updates requests a sweep, but not
+// within MPPT_SWEEP_DROP_HOLDOFF_UPDATES updates after the last one (passing clouds)
+#define MPPT_SWEEP_DROP_SHIFT           2   // 25 %
+#define MPPT_SWEEP_DROP_HOLDOFF_UPDATES ((uint16_t)(30000UL / MPPT_UPDATE_INTERVAL_MS)) // 30 s
+
+/*
+ * Warm start: while the buck stages are off the panel voltage is its open circuit voltage Voc. The MPP of crystalline
+ * panels lies at an almost constant fraction of Voc, so startCharging() aims at that voltage instead of at Voc. The
+ * fraction starts at MPPT_VOC_FRACTION_DEFAULT and is refined from the maxima that the sweeps find.
+ */
+#define MPPT_VOC_FRACTION_DEFAULT   205 // [1/256] 0.80
+#define MPPT_VOC_FRACTION_MIN       154 // [1/256] 0.60
+#define MPPT_VOC_FRACTION_MAX       243 // [1/256] 0.95
+
+/*
+ * Feed-forward: in continuous conduction the buck keeps panel voltage = battery voltage / duty cycle. When the battery
+ * voltage steps (a load switches on or off), every update scales the duty cycle by the ratio of the new to the old
+ * battery voltage, so the panel stays at the operating point of the tracker instead of being walked back there step
+ * by step. The panel voltage is deliberately not fed forward: it follows the duty cycle, so Vbat * TOP / Vpanel of
+ * the measured panel voltage would amplify every perturbation of the tracker (positive feedback).
+ */
+#define MPPT_FEED_FORWARD_DEADBAND  30  // [mV] smaller battery voltage changes are left to the trackers
+
+void update_mppt(const measurements_t * measurements, ChargingProfile * profile);
+
+/*
+ * returns the estimated MPP voltage Voc * fraction [mV], or 0 if no Voc has been recorded yet.
+ */
+uint16_t mppt_getStartVoltage(void);
+
+/*
+ * start a sweep with the next update_mppt() call, e.g. after a sudden drop of the panel power.
+ */
+void mppt_requestSweep(void);
+
+/*
+ * returns the energy that was not harvested because of sweeps since power-up [J], relative to the power right
+ * before each sweep.
+ */
+uint32_t mppt_getSweepLoss(void);
 
 #endif /* INC_MPPT_H_ */
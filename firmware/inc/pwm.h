@@ -46,7 +46,7 @@ Use Timer0 and Timer2 (both 8 Bit) for phase shifted pwm (16 MHz / 256 = 62.5 kH
 #define PWM_HIGH_F_INIT_OFFSET      (PWM_HIGH_F_TOP * 4UL / 100)
 
 
-// TODO: On the fly switching not implemented, yet!
+// settings for startCharging(), pwm_setFrequency() switches to the others at runtime
 #define PWM_TOP                     PWM_HIGH_F_TOP
 #define PWM_BOTTOM                  PWM_HIGH_F_BOTTOM
 #define PWM_STEP                    PWM_HIGH_F_STEP
@@ -54,6 +54,23 @@ Use Timer0 and Timer2 (both 8 Bit) for phase shifted pwm (16 MHz / 256 = 62.5 kH
 #define PWM_MIN                     PWM_HIGH_F_MIN
 #define PWM_INIT_OFFSET             PWM_HIGH_F_INIT_OFFSET
 
+/*
+Dithering: the duty cycle has PWM_DITHER_BITS fractional bits below the 7/8 bit timer resolution. Every PWM period
+the timer0 overflow interrupt writes either pwm or pwm + 1 to OCR0B/OCR2B, chosen by a first order sigma-delta
+modulator, so the average duty cycle has an effective resolution of 11/12 bit. The pattern repeats after at most 16
+PWM periods (128 us at 125 kHz), far below the ADC filter time constants and the MPPT interval, so the trackers see
+the average duty cycle and the ripple is left to the buck inductors and capacitors. The interrupt costs about
+PWM_DITHER_ISR_CYCLES of the 128 CPU cycles of a 125 kHz period, so it is only used where it pays off: pwm_setDither()
+allows a fraction only while the PI regulator holds a limit or the tracker steps by less than one count near the
+MPP. Otherwise pwm_setFine() rounds to whole counts and the interrupt stays off. goToIdle() deducts its cost from the
+idle time.
+pwm_stepUp()/pwm_stepDown() move by PWM_STEP timer counts as before, pwm_stepUpBy()/pwm_stepDownBy() take fine steps.
+*/
+#define PWM_DITHER_BITS             4
+#define PWM_DITHER_STEPS            (1 << PWM_DITHER_BITS)
+#define PWM_FINE(value)             ((uint16_t)(value) << PWM_DITHER_BITS) // convert timer counts to fine steps
+#define PWM_DITHER_ISR_CYCLES       50 // [CPU cycles] estimate for the overflow interrupt incl. entry and return
+
 typedef enum
 {
     pwm_frequencyMinimal = 0, // ~1 kHz, pwm set to max
@@ -104,14 +121,15 @@ typedef enum
 
 typedef enum
 {
+    // timer0 has a different prescaler table than timer2: no div32 and div128
     timer0_ClockSelect_stopped = 0,
     timer0_ClockSelect_1 = 1 << CS00,
     timer0_ClockSelect_div8 = 1 << CS01,
-    timer0_ClockSelect_div32 = 1 << CS01 | 1 << CS00,
-    timer0_ClockSelect_div64 = 1 << CS02,
-    timer0_ClockSelect_div128 = 1 << CS02 | 1 << CS00,
-    timer0_ClockSelect_div256 = 1 << CS02 | 1 << CS01,
-    timer0_ClockSelect_div1024 = 1 << CS02 | 1 << CS01 | 1 << CS00
+    timer0_ClockSelect_div64 = 1 << CS01 | 1 << CS00,
+    timer0_ClockSelect_div256 = 1 << CS02,
+    timer0_ClockSelect_div1024 = 1 << CS02 | 1 << CS00,
+    timer0_ClockSelect_externalFalling = 1 << CS02 | 1 << CS01,
+    timer0_ClockSelect_externalRising = 1 << CS02 | 1 << CS01 | 1 << CS00
 } timer0_ClockSelect_t;
 
 typedef enum
@@ -188,10 +206,23 @@ void pwm_init(void);
 void pwm_set(uint8_t pwm);
 uint8_t pwm_stepDown(void);
 uint8_t pwm_stepUp(void);
+uint8_t pwm_stepDownBy(uint8_t step);
+uint8_t pwm_stepUpBy(uint8_t step);
+void pwm_setFine(uint16_t value);
+uint16_t pwm_getFine(void);
+void pwm_setDither(uint8_t enable);
+uint8_t pwm_isDithering(void);
 uint8_t pwm_get(void);
+uint8_t pwm_getMin(void);
+uint8_t pwm_getMax(void);
 void pwm_0deg_disable(void);
 void pwm_180deg_disable(void);
 void pwm_0deg_enable(pwm_frequency_t pwm_frequency);
 void pwm_180deg_enable(pwm_frequency_t pwm_frequency);
+uint8_t pwm_180deg_isEnabled(void);
+pwm_frequency_t pwm_getFrequency(void);
+void pwm_setFrequency(pwm_frequency_t pwm_frequency);
+uint8_t pwm_getTop(void);
+uint16_t pwm_getPeriod(void);
 #endif
 
@@ -12,6 +12,8 @@
 #ifndef INC_PWR_MANAGEMENT_H_
 #define INC_PWR_MANAGEMENT_H_
 
+#include <stdint.h>
+
 /* define GPIO port that controls power to the PTCs and the external ADC reference voltage source */
 #define PTC_ADCREF_PORT      PORTB
 #define PTC_ADCREF_DDR       DDRB
@@ -23,9 +25,64 @@ void PTC_ADCref_on(void);
 void PTC_ADRref_off(void);
 
 /*
- * activate watchdog, shutdown all other stuff and go to sleep
+ * Adaptive night sleep: every watchdog cycle lasts 8 s, the ISR only counts it and the CPU goes back to sleep at
+ * once. After every SLEEP_DARK_WAKEUPS consecutive dark wake-ups (panel voltage below battery voltage) the number of
+ * chained cycles doubles, up to SLEEP_WDT_CYCLES_MAX. The first wake-up that is not dark starts over with one cycle.
+ * With SLEEP_COMPARATOR_WAKE the CPU sleeps in idle mode at F_CPU / 256 instead of power down, because only that
+ * mode is woken by the analog comparator. It compares the bandgap (approx. 1.1 V) with the panel voltage divider on
+ * ADC2, which wakes the CPU at once when the panel exceeds approx. 20.7 V (18.9..22.6 V with the bandgap
+ * tolerance). This costs some 100 uA more than power down, but dawn is detected without delay, so
+ * SLEEP_WDT_CYCLES_MAX can be larger.
+ */
+#define SLEEP_WDT_CYCLES_MAX        8   // 8 x 8 s = 64 s between two checks of the panel at most
+#define SLEEP_DARK_WAKEUPS          16  // approx. 2 minutes of darkness at 8 s before the first doubling
+//#define SLEEP_COMPARATOR_WAKE
+#define SLEEP_COMPARATOR_CHANNEL    2   // ADC2: panel voltage
+
+/*
+ * activate watchdog, shutdown all other stuff and go to sleep. dark: the panel voltage was below the battery voltage
+ */
+void goToSleep (uint8_t dark);
+
+/*
+ * Idle sleep between the scheduler ticks: the CPU halts in SLEEP_MODE_IDLE, timers, PWM, ADC and UART keep running
+ * and any of their interrupts wakes it up. The time spent asleep is measured with timer1 (CPU clock, period
+ * OCR1A + 1) and gives an estimate of the supply current saved, based on the typical ATmega328P supply currents at
+ * 16 MHz / 5 V. The CPU only leaves goToIdle() when a task has been released; other interrupts (ADC, UART, PWM
+ * dither) send it back to sleep at once. Their run time is counted as sleep time, except for the dither interrupt,
+ * whose estimated cost PWM_DITHER_ISR_CYCLES per PWM period is deducted.
+ */
+#define IDLE_ACTIVE_CURRENT_UA      9000 // [uA] active, 16 MHz, 5 V
+#define IDLE_IDLE_CURRENT_UA        2500 // [uA] idle, 16 MHz, 5 V
+
+/*
+ * sleep until the scheduler releases a task, unless one has been released already.
  */
-void goToSleep (void);
+void goToIdle(void);
+
+/*
+ * returns the share of time spent in idle sleep since the last call [%]. Call it at least every 60 s (tick wrap).
+ */
+uint8_t getIdlePercent(void);
+
+/*
+ * returns the estimated MCU supply current saved by idle sleep since the last getIdlePercent() call [uA].
+ */
+uint16_t getIdleSavedCurrent(void);
+
+/*
+ * Clock scaling: while the buck stages are off the CPU runs at F_CPU >> CLOCK_SLOW_SHIFT (2 MHz) via the CLKPR
+ * prescaler. clock_slow()/clock_fast() keep the dependent settings in step: the 2 ms time base (OCR1A), the ADC
+ * prescaler and the soft-I2C delays. The UART is not rescaled: 38400 Bd from 2 MHz are 8.5 % off, so nothing must be
+ * sent at the slow clock (clock_getShift() != 0). The buck PWM timers require F_CPU, startCharging() calls
+ * clock_fast() before it enables them.
+ */
+#define CLOCK_SLOW_DIV              clock_div_8
+#define CLOCK_SLOW_SHIFT            3
+
+void clock_slow(void);
+void clock_fast(void);
+uint8_t clock_getShift(void);
 
 /*
  * switch off power to hardware i2c interface.
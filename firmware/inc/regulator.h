@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: 2023 2023 Dipl.-Ing. Jochen Menzel (Jehdar@gmx.de)
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _REGULATOR_H__
+#define _REGULATOR_H__
+
+#include <stdint.h>
+#include "measurement.h"
+
+/*
+ * PI regulator for the CV and current limit modes. It takes over from the MPP tracker as soon as the battery voltage
+ * exceeds charger_read_target_voltage() or the charge current exceeds charger_read_target_current() and runs once per
+ * ADC scan round, when the battery voltage and the charge current both have a fresh sample. Both limits are checked
+ * in every update, the one that is closer to being violated drives the loop (current error >> REGULATOR_CURRENT_SHIFT
+ * counts like a voltage error in mV).
+ * The output is the duty cycle in fine pwm steps. The integrator starts at the duty cycle that the tracker left
+ * (bumpless transfer) and is limited to pwm_min..pwm_max; it stops integrating while the output is saturated
+ * (anti-windup). When the panel can no longer supply the setpoint, the error stays positive: after
+ * REGULATOR_RELEASE_UPDATES updates above REGULATOR_RELEASE_MARGIN, or at once at pwm_max, the regulator hands back
+ * to the tracker. It returns to the last duty cycle that held the setpoint within the margin first, so the tracker
+ * does not start from pwm_max.
+ */
+#define REGULATOR_KP                32  // [fine pwm steps / 256 per mV]
+#define REGULATOR_KI                1   // [fine pwm steps / 256 per mV and update]
+#define REGULATOR_CURRENT_SHIFT     3   // [mA] >> 3 ~ [mV]
+#define REGULATOR_RELEASE_MARGIN    50  // [mV] error that counts as "setpoint out of reach"
+#define REGULATOR_RELEASE_UPDATES   128 // approx. 0.45 s at one update per scan round (approx. 3.5 ms)
+
+
+/*
+ * run one regulator step while charging. Engages on a violated CV/CC limit, releases on overtemperature (the
+ * tracker reduces the current then) and when the setpoint is out of reach.
+ */
+void regulator_update(const measurements_t * measurements);
+
+/*
+ * returns non-zero while the regulator controls the duty cycle and the MPP tracker has to hold still.
+ */
+uint8_t regulator_isActive(void);
+
+/*
+ * hand the duty cycle back to the tracker, e.g. when charging starts or stops.
+ */
+void regulator_release(void);
+
+#endif
@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2023 2023 Dipl.-Ing. Jochen Menzel (Jehdar@gmx.de)
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _SCHEDULER_H__
+#define _SCHEDULER_H__
+
+#include <stdint.h>
+
+/*
+Cooperative time-triggered scheduler. The timer1 time base interrupt releases the tasks of a static table at their
+period and phase offset (all in ms, multiples of TIME_INTERVAL_MS); the main loop runs the released tasks one after
+the other in table order, so the first entries have the highest priority. A task is not preempted by other tasks.
+Two kinds of overrun are counted per task instead of stretching the loop:
+- the task is released again while the previous release has not run yet,
+- the task finishes later than its deadline after the release.
+*/
+
+#define SCHEDULER_TASKS_MAX     8   // size of the pending bit mask
+
+typedef struct
+{
+    void (*run)(void);
+    uint16_t period;    // [ms]
+    uint16_t phase;     // [ms] first release after scheduler_init()
+    uint16_t deadline;  // [ms] latest end of the task after its release
+} scheduler_task_t;
+
+
+void scheduler_init(const scheduler_task_t *tasks, uint8_t count);
+
+/*
+ * called from the time base interrupt with the free running ms tick.
+ */
+void scheduler_tick(uint16_t tick);
+
+/*
+ * run all released tasks once. Returns the number of tasks that ran.
+ */
+uint8_t scheduler_run(void);
+
+/*
+ * returns non-zero if a task has been released and did not run yet.
+ */
+uint8_t scheduler_isPending(void);
+
+/*
+ * release a task at once, independent of its period (e.g. after a wake-up from power down sleep).
+ */
+void scheduler_release(uint8_t index);
+
+/*
+ * returns the overruns of a task since scheduler_init().
+ */
+uint16_t scheduler_getOverruns(uint8_t index);
+
+#endif
@@ -41,11 +41,8 @@ void uart_puts(char *s);
 void uart_puts_P(const char *s);
 
 
-// Wait until all data is sent.
-static inline void uart_flush (void)
-{
-	while (UCSR0B & (1 << UDRIE0)) {}
-}
+// Wait until all data is sent, including the last byte in the transmit shift register.
+void uart_flush(void);
 
 
 /*
@@ -5,25 +5,120 @@
 
 #include <adc.h>
 #include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/delay.h>
 
 /*
 Use the analog/digital-converter a more comfortable way.
 
-Missing features: input-gain, auto trigger enable
+Missing features: input-gain
 
 Target:      ATMega48, ATMega88, ATMega168, ATMega328
 Last Change: 2012-04-24 (Frank Baettermann)
 */
 
+
+// state of the background scan engine
+static uint8_t adc_prescalerReg = ADC_PRESCALER_REG; // ADPS bits, changed by adc_setPrescaler()
+static const adc_scanChannel *adc_scanTable;    // descriptors of the channels to convert
+static uint8_t adc_scanLength;                  // number of channels in the table
+static volatile uint8_t adc_scanRunning = 0;    // ISR starts the next conversion only while set
+static uint8_t adc_scanIndex;                   // table position of the channel being converted
+static uint8_t adc_scanCountdown[ADC_SCAN_CHANNELS_MAX]; // scan rounds until a channel is due again
+static uint8_t adc_scanDue;                     // bit n set: table position n is converted in this round
+static uint8_t adc_scanCount;                   // samples left in the visit of the current channel
+static uint8_t adc_scanShift;                   // filter shift of the current channel
+static volatile uint16_t adc_scanFilter[ADC_SCAN_CHANNELS_MAX]; // moving averages, scaled by 2^shift
+static uint8_t adc_scanPrimed;                  // bit n set: filter at table position n holds valid data
+static volatile uint8_t adc_scanUpdated = 0;    // bit n set: new result at table position n since last read
+static volatile uint8_t adc_scanCycle = 0;      // incremented whenever a scan round completed
+static adc_syncPhase adc_scanSyncPhase = adc_syncPhaseMidOn;
+static uint16_t adc_scanLimit[ADC_SCAN_CHANNELS_MAX]; // raw 10 bit limits, ADC_SCAN_LIMIT_NONE if not watched
+static adc_scanLimitHandler adc_scanLimitExceeded = 0;
+static uint8_t adc_scanSynced;                  // the current channel is converted PWM synchronized
+
+
+// decide which channels are due in the next scan round. Skips empty rounds, so at least one channel is due.
+static inline void adc_scanNewRound(void)
+{
+    uint8_t due = 0;
+    do
+    {
+        for (uint8_t i = 0; i < adc_scanLength; i++)
+        {
+            if (adc_scanCountdown[i] == 0)
+            {
+                due |= 1 << i;
+                adc_scanCountdown[i] = adc_scanTable[i].period - 1;
+            }
+            else
+                adc_scanCountdown[i]--;
+        }
+    }
+    while (!due);
+    adc_scanDue = due;
+}
+
+
+// select the channel at the current table position and decide how to convert it
+static inline void adc_scanSelect(void)
+{
+    const adc_scanChannel *descriptor = &adc_scanTable[adc_scanIndex];
+
+    adc_setChannel(descriptor->channel);
+    adc_scanCount = descriptor->samples;
+    adc_scanShift = descriptor->shift;
+    // synchronize only while timer0 runs from the undivided system clock (62.5 kHz and 125 kHz PWM)
+    adc_scanSynced = descriptor->sync && ((TCCR0B & 0x07) == (1 << CS00));
+}
+
+
+// start the next conversion, either right now or at the selected phase of the timer0 PWM
+static inline void adc_scanTrigger(void)
+{
+    uint8_t top, phase, t0;
+    uint16_t t1, next;
+
+    // the phase calculation needs timer0 to count the CPU clock, like timer1 does
+    if (!adc_scanSynced || (TCCR0B & ((1 << CS02) | (1 << CS01) | (1 << CS00))) != (1 << CS00))
+    {
+        ADCSRA |= (1 << ADSC);
+        return;
+    }
+
+    // fast PWM counts from 0 to top; OC0B is high from 0 to OCR0B.
+    top = OCR0A;
+    if (adc_scanSyncPhase == adc_syncPhaseMidOn)
+        phase = OCR0B >> 1;
+    else
+        phase = ((uint16_t)OCR0B + top + 1) >> 1;
+    // trigger early by the sample and hold delay. Period lengths of 128 and 256 make "& top" a modulo.
+    phase = (uint8_t)(phase - ADC_SYNC_DELAY) & top;
+
+    t0 = TCNT0;
+    t1 = TCNT1;
+    // place the compare match one to two PWM periods ahead, leaving time to finish this ISR
+    next = t1 + ((phase - t0) & top) + top + 1;
+    if (next > OCR1A)
+        next -= OCR1A + 1;
+    OCR1B = next;
+    // the ADC triggers on the rising edge of OCF1B, so clear the flag of the previous match
+    TIFR1 = 1 << OCF1B;
+}
+
+
 void adc_init(adc_voltageReference voltageReference, adc_adjustResult adjustResult, adc_interrupt interrupt, adc_autoTrigger autoTrigger, adc_autoTriggerSource autoTriggerSource)
 {
     // ADMUX – ADC Multiplexer Selection Register
     ADMUX = voltageReference | adjustResult;
     /*
      * ADCSRA – ADC Control and Status Register A.
-     * adc.h automatically calculates prescaler settings for maximum allowable ADC clock.
+     * adc.h automatically calculates prescaler settings for maximum allowable ADC clock,
+     * adc_setPrescaler() adapts them to a reduced CPU clock.
      */
-    ADCSRA = autoTrigger | interrupt | ADC_PRESCALER_REG;
+    ADCSRA = autoTrigger | interrupt | adc_prescalerReg;
     // ADCSRB – ADC Control and Status Register B
     ADCSRB = autoTriggerSource;
     // disable digital input buffers for the six double-usage pins - we use all of them as analog inputs.
@@ -31,10 +126,45 @@ void adc_init(adc_voltageReference voltageReference, adc_adjustResult adjustResu
 }
 
 
+// select the ADC clock prescaler (ADPS bits), e.g. after a change of the CPU clock. The conversion in progress may
+// be off once, the scan filters smooth that out.
+void adc_setPrescaler(uint8_t prescalerReg)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        adc_prescalerReg = prescalerReg;
+        // writing back a set ADIF would clear it and lose the ISR that continues the scan
+        ADCSRA = (ADCSRA & ~(1 << ADIF | 1 << ADPS2 | 1 << ADPS1 | 1 << ADPS0)) | prescalerReg;
+    }
+}
+
+
 // single conversion of selected channel
-// With ADC_clock = 16 MHz / 128 = 125kHz and 13 ADC_clock cycles per conversion, this takes 1.04ms.
+// With ADC_clock = 16 MHz / 128 = 125kHz and 13 ADC_clock cycles per conversion, this takes 104 us.
+// Do not use while the background scan is running.
 uint16_t adc_singleConversion(void)
 {
+#ifdef ADC_NOISE_REDUCTION
+    // timer0 stopped -> no buck PWM that ADC noise reduction mode could freeze
+    if (!(TCCR0B & 0x07))
+    {
+        // entering ADC noise reduction mode starts the conversion, ADC_vect wakes the CPU up again
+        ADCSRA |= (1 << ADIE);
+        set_sleep_mode(SLEEP_MODE_ADC);
+        cli();
+        do
+        {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+            cli();
+        }
+        while (ADCSRA & (1 << ADSC));
+        sei();
+        return ADCW;
+    }
+#endif
     ADCSRA |= (1 << ADSC); // start conversion
     while (ADCSRA & (1 << ADSC)); // loop until the conversion is complete
     return ADCW;
@@ -42,7 +172,7 @@ uint16_t adc_singleConversion(void)
 
 
 // 16x supersampling to achieve 12 bit resolution with 10 bit ADC
-// since each sample needs roughly 1.04 ms, this takes approx.  16,64 ms.
+// since each sample needs roughly 104 us, this takes approx. 1.7 ms.
 uint16_t adc_12BitConversion(uint8_t channel)
 {
     uint16_t adc = 0;
@@ -52,6 +182,251 @@ uint16_t adc_12BitConversion(uint8_t channel)
     return adc >> 2; // divide by 4
 }
 
+/*
+ * set up the channel descriptors for the background scan. The table is not copied and must stay valid.
+ */
+void adc_scanInit(const adc_scanChannel *table, uint8_t count)
+{
+    adc_scanStop();
+    if (count > ADC_SCAN_CHANNELS_MAX)
+        count = ADC_SCAN_CHANNELS_MAX;
+    adc_scanTable = table;
+    adc_scanLength = count;
+    for (uint8_t i = 0; i < ADC_SCAN_CHANNELS_MAX; i++)
+        adc_scanLimit[i] = ADC_SCAN_LIMIT_NONE;
+}
+
+
+/*
+ * watch every raw 10 bit sample of the channel at position index of the table against limit.
+ * ADC_SCAN_LIMIT_NONE stops watching.
+ */
+void adc_scanSetLimit(uint8_t index, uint16_t limit)
+{
+    if (index >= ADC_SCAN_CHANNELS_MAX)
+        return;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        adc_scanLimit[index] = limit;
+    }
+}
+
+
+/*
+ * set the function that ADC_vect calls when a sample exceeds its limit.
+ */
+void adc_scanSetLimitHandler(adc_scanLimitHandler handler)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        adc_scanLimitExceeded = handler;
+    }
+}
+
+
+/*
+ * select the phase of the timer0 PWM at which synchronized channels are sampled.
+ */
+void adc_scanSetSyncPhase(adc_syncPhase phase)
+{
+    adc_scanSyncPhase = phase;
+}
+
+
+/*
+ * (re-)start the scan. The first round converts every channel, afterwards the channels with equal periods are
+ * staggered by their table position so that the slow ones do not all fall into the same round.
+ * The filters restart from the first sample of each channel. The ADC has to be enabled.
+ */
+void adc_scanStart(void)
+{
+    if (adc_scanLength == 0)
+        return;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (uint8_t i = 0; i < adc_scanLength; i++)
+            adc_scanCountdown[i] = 0;
+        adc_scanNewRound();
+        for (uint8_t i = 0; i < adc_scanLength; i++)
+        {
+            uint8_t period = adc_scanTable[i].period;
+            uint16_t countdown;
+
+            if (period <= 1)
+                continue;
+            // delay by i rounds, or by i modulo period if that does not fit into the uint8_t countdown
+            countdown = adc_scanCountdown[i] + i % period;
+            if (countdown > UINT8_MAX)
+                countdown -= period;
+            adc_scanCountdown[i] = countdown;
+        }
+        adc_scanIndex = 0;
+        adc_scanPrimed = 0;
+        adc_scanSelect();
+        adc_scanRunning = 1;
+        ADCSRA |= (1 << ADIE);
+        adc_scanTrigger();
+    }
+}
+
+
+/*
+ * let the ongoing conversion finish without starting another one, e.g. before adc_disable().
+ */
+void adc_scanStop(void)
+{
+    adc_scanRunning = 0;
+}
+
+
+/*
+ * wait until the current scan round completed.
+ * With ADC_NOISE_REDUCTION the CPU sleeps during the conversions as long as the buck PWM is stopped. The time
+ * base does not advance while sleeping (approx. 3.5 ms per scan round), so only use this where that does not
+ * matter, e.g. when waking up from power-down sleep.
+ */
+void adc_scanWait(void)
+{
+    uint8_t cycle = adc_scanCycle;
+
+    if (!adc_scanRunning)
+        return;
+#ifdef ADC_NOISE_REDUCTION
+    if (!(TCCR0B & 0x07))
+    {
+        // the ISR starts the next conversion right before the CPU goes back to sleep
+        set_sleep_mode(SLEEP_MODE_ADC);
+        cli();
+        while (adc_scanCycle == cycle)
+        {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+            cli();
+        }
+        sei();
+        return;
+    }
+#endif
+    while (adc_scanCycle == cycle);
+}
+
+
+/*
+ * returns a counter that advances whenever a scan round completed.
+ */
+uint8_t adc_scanGetCycle(void)
+{
+    return adc_scanCycle;
+}
+
+
+/*
+ * returns the table positions (bit n = position n) that got a new result since the last call.
+ */
+uint8_t adc_scanGetUpdated(void)
+{
+    uint8_t updated;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        updated = adc_scanUpdated;
+        adc_scanUpdated = 0;
+    }
+    return updated;
+}
+
+
+/*
+ * returns the filtered 12 bit result of the channel at position index of the table.
+ */
+uint16_t adc_scanGetResult(uint8_t index)
+{
+    uint16_t filter;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        filter = adc_scanFilter[index];
+    }
+    return filter >> (adc_scanTable[index].shift - ADC_SCAN_SHIFT_MIN);
+}
+
+
+// Conversion complete: update the filter of the current channel and, at the end of its visit, advance to the next
+// channel that is due in this round. A conversion takes 13 ADC clock cycles = 104 us at 125 kHz.
+ISR(ADC_vect)
+{
+    uint8_t mask;
+    uint16_t sample;
+    uint16_t filter;
+
+    // conversions of adc_singleConversion() and the last one after adc_scanStop() only wake the CPU up
+    if (!adc_scanRunning)
+        return;
+    sample = ADCW;
+    if (sample > adc_scanLimit[adc_scanIndex] && adc_scanLimitExceeded)
+        adc_scanLimitExceeded(adc_scanIndex);
+    mask = 1 << adc_scanIndex;
+    if (adc_scanPrimed & mask)
+    {
+        filter = adc_scanFilter[adc_scanIndex];
+        filter -= filter >> adc_scanShift;
+        filter += sample;
+    }
+    else
+    {
+        // seed with the first sample instead of ramping up from zero
+        filter = sample << adc_scanShift;
+        adc_scanPrimed |= mask;
+    }
+    adc_scanFilter[adc_scanIndex] = filter;
+    if (--adc_scanCount == 0)
+    {
+        adc_scanUpdated |= mask;
+        do
+        {
+            if (++adc_scanIndex == adc_scanLength)
+            {
+                adc_scanIndex = 0;
+                adc_scanCycle++;
+                adc_scanNewRound();
+            }
+        }
+        while (!(adc_scanDue & (1 << adc_scanIndex)));
+        // the multiplexer may be switched safely because no conversion is running right now
+        adc_scanSelect();
+    }
+    adc_scanTrigger();
+}
+
+
+static volatile uint8_t analog_comparator_triggered = 0;
+
+/*
+ * wake-up comparator: the bandgap reference at the positive input, ADC channel at the negative input via the ADC
+ * multiplexer (ACME, only while the ADC is disabled). Interrupts once when the channel voltage rises above the
+ * bandgap voltage (ACO falls). adc_init() switches the multiplexer back to the ADC.
+ */
+void analog_comparator_enableWake(uint8_t channel){
+	analog_comparator_triggered = 0;
+	ADMUX = (ADMUX & 0xF0) | channel;
+	ADCSRB |= (1<<ACME);
+	//select the edge with the interrupt disabled, it could fire otherwise
+	ACSR = (1<<ACBG) | (1<<ACIS1);
+	//let the bandgap reference settle
+	_delay_us(70);
+	ACSR = (1<<ACBG) | (1<<ACI) | (1<<ACIE) | (1<<ACIS1);
+}
+
+uint8_t analog_comparator_isTriggered(void){
+	return analog_comparator_triggered;
+}
+
+ISR(ANALOG_COMP_vect){
+	ACSR &= ~(1<<ACIE);
+	analog_comparator_triggered = 1;
+}
+
+
 /*
  * disable power to analog comparator
  */
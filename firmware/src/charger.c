@@ -3,11 +3,16 @@
 //
 // SPDX-License-Identifier: Apache-2.0
 
+#include <util/atomic.h>
+#include "adc.h"
 #include "charger.h"
 #include "datetime.h"
 #include "measurement.h"
 #include "main.h"
+#include "mppt.h"
 #include "pwm.h"
+#include "regulator.h"
+#include "pwr_management.h"
 
 static ChargingProfile *_profile;          // all charging profile variables
 static int _state;                         // valid states: enum charger_states
@@ -20,7 +25,8 @@ static int _time_voltage_limit_reached;    // last time the CV limit was reached
 static bool _discharging_enabled;
 #endif
 
-chargerStatus_t chargerStatus = chargerStatus_idle;
+// volatile: the fast trip sets fault flags from ADC_vect, so read-modify-write it atomically elsewhere
+volatile chargerStatus_t chargerStatus = chargerStatus_idle;
 
 // private function
 
@@ -30,6 +36,36 @@ chargerStatus_t chargerStatus = chargerStatus_idle;
  */
 void charger_enter_state(int next_state);
 
+// burst mode
+typedef enum
+{
+    charger_burstOff = 0,
+    charger_burstPause,     // buck stages off, the panel charges the input capacitors
+    charger_burstOn         // 0° stage running
+} charger_burstState_t;
+
+static charger_burstState_t charger_burstState = charger_burstOff;
+static uint16_t charger_burstTick;  // start of the present pause or burst [ms]
+
+#ifdef PROTECTION_FAST_TRIP
+/*
+ * called from ADC_vect as soon as a single sample of a watched channel exceeds its limit: shut down both buck
+ * stages right now and latch the fault. The main loop does the rest of stopCharging(). While not charging the
+ * limits are not a fault of this charger, e.g. another charger may hold the battery above the voltage limit.
+ */
+static void charger_trip(uint8_t index)
+{
+    pwm_0deg_disable();
+    pwm_180deg_disable();
+    if (!isCharging())
+        return;
+    if (index == measurement_chargeCurrent)
+        chargerStatus |= chargerStatus_overcurrent;
+    else
+        chargerStatus |= chargerStatus_overvoltage;
+}
+#endif
+
 
 void charger_init(ChargingProfile *profile)
 {
@@ -39,6 +75,11 @@ void charger_init(ChargingProfile *profile)
     _time_state_changed = -profile->time_limit_recharge;     // start immediately
     _target_current = profile -> charge_current_max;
     _target_voltage = profile-> battery_voltage_max;
+#ifdef PROTECTION_FAST_TRIP
+    adc_scanSetLimitHandler(charger_trip);
+    adc_scanSetLimit(measurement_chargeCurrent, PROTECTION_CHARGE_CURRENT_ADC);
+    adc_scanSetLimit(measurement_batteryVoltage, PROTECTION_BATTERY_VOLTAGE_ADC);
+#endif
 }
 
 void profile_init(ChargingProfile *profile){
@@ -63,7 +104,8 @@ void profile_init(ChargingProfile *profile){
     // system control
     profile -> charge_panel_current_min = 20; 		// [mA]
     profile -> restart_charging_time = 5; 			// [s]
-    profile -> mppt_panel_current_min = 100;		// [mA] is the minimum panel current needed to do MPPT.
+    profile -> mppt_panel_current_min = 50;		// [mA] is the minimum panel current needed to do MPPT.
+    profile -> mppt_algorithm = MPPT_ALGORITHM_DEFAULT;
 }
 
 //extern chargerStatus_t chargerStatus = chargerStatus_idle;
@@ -71,23 +113,171 @@ void profile_init(ChargingProfile *profile){
 
 void startCharging(void)
 {
-    chargerStatus |= chargerStatus_charging;
+    const measurements_t *measurements = measurement_getSnapshot();
+
+    // the buck PWM timers need the full CPU clock
+    clock_fast();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // restarting after a trip is a new attempt
+        chargerStatus = (chargerStatus & ~(chargerStatus_overcurrent | chargerStatus_overvoltage))
+                      | chargerStatus_charging;
+    }
+
+    // Aim at the estimated MPP voltage (learned fraction of Voc) instead of the present, open circuit panel voltage
+    uint16_t panelVoltage = mppt_getStartVoltage();
+    if (panelVoltage <= measurements->batteryVoltage.v)
+        panelVoltage = measurements->panelVoltage.v;
 
     // Guess initial pwm setting: pwm = batteryVoltage * PWM_TOP / panelVoltage + offset
-    uint16_t pwm = (uint16_t)(((uint32_t)measurements.batteryVoltage.v * PWM_TOP) / measurements.panelVoltage.v) + PWM_INIT_OFFSET;
+    uint16_t pwm = (uint16_t)(((uint32_t)measurements->batteryVoltage.v * PWM_TOP) / panelVoltage) + PWM_INIT_OFFSET;
 
     if (pwm > PWM_MAX)
         pwm = PWM_MAX;
     if (pwm < PWM_MIN)
         pwm = PWM_MIN;
     pwm_set(pwm);
+    regulator_release();
+    charger_burstState = charger_burstOff;
+    // start with the 0° stage only, charger_shedPhases() adds the 180° stage once the panel current is high enough
     pwm_0deg_enable(pwm_frequencyHigh);
-    pwm_180deg_enable(pwm_frequencyHigh);
 }
 
+
+/*
+ * Frequency selection with hysteresis (thresholds in main.h): at low panel current the buck stages run at minimal
+ * frequency with maximum duty cycle (no MPPT), in the normal range at 125 kHz and at high current at 62.5 kHz,
+ * where the switching losses per period matter more than the inductor ripple.
+ */
+void charger_selectFrequency(const measurements_t * measurements)
+{
+    uint16_t current = measurements->panelCurrent.v;
+
+    if (!isCharging() || isFault() || charger_isBursting())
+        return;
+
+    switch (pwm_getFrequency()) {
+    	case pwm_frequencyMinimal:
+    	    if (current > PANEL_CURRENT_MINIMAL_F_UP)
+    	    	pwm_setFrequency(pwm_frequencyHigh);
+    	    break;
+
+    	case pwm_frequencyHigh:
+    	    if (current < PANEL_CURRENT_NORMAL_F_DOWN)
+    	    	pwm_setFrequency(pwm_frequencyMinimal);
+    	    else if (current > PANEL_CURRENT_NORMAL_F_UP)
+    	    	pwm_setFrequency(pwm_frequencyMedium);
+    	    break;
+
+    	case pwm_frequencyMedium:
+    	default:
+    	    if (current < PANEL_CURRENT_HIGH_F_DOWN)
+    	    	pwm_setFrequency(pwm_frequencyHigh);
+    	    break;
+    }
+}
+
+
+/*
+ * Phase shedding: below PANEL_CURRENT_SHTDN_180DEG the switching and gate drive losses of the second buck stage
+ * exceed what it saves in conduction losses, so the 0° stage runs alone. Above PANEL_CURRENT_ACTIVATE_180DEG the
+ * 180° stage is started in phase with the running 0° stage.
+ */
+void charger_shedPhases(const measurements_t * measurements)
+{
+    if (!isCharging() || isFault() || charger_isBursting())
+        return;
+
+    if (pwm_180deg_isEnabled())
+    {
+        if (measurements->panelCurrent.v < PANEL_CURRENT_SHTDN_180DEG)
+            pwm_180deg_disable();
+    }
+    else if (measurements->panelCurrent.v > PANEL_CURRENT_ACTIVATE_180DEG)
+        pwm_180deg_enable(pwm_getFrequency());
+}
+
+void charger_startBurst(void)
+{
+    pwm_180deg_disable();
+    pwm_0deg_disable();
+    regulator_release();
+    charger_burstState = charger_burstPause;
+    charger_burstTick = datetime_getTick();
+}
+
+
+uint8_t charger_isBursting(void)
+{
+    return charger_burstState != charger_burstOff;
+}
+
+
+/*
+ * Burst mode: switch the 0° stage on and off with a hysteresis around the estimated MPP voltage. The input
+ * capacitors store the panel energy during the pause, a burst transfers it at a duty cycle that matches the MPP
+ * voltage. The thresholds stay above the battery voltage, otherwise the buck could not deliver anything.
+ */
+void charger_burst(const measurements_t * measurements)
+{
+    uint16_t tick, mpp, upper, lower, duty;
+
+    if (charger_burstState == charger_burstOff)
+        return;
+
+    tick = datetime_getTick();
+    mpp = mppt_getStartVoltage();
+    if (mpp < measurements->batteryVoltage.v + 2 * BURST_VOLTAGE_HYSTERESIS)
+        mpp = measurements->batteryVoltage.v + 2 * BURST_VOLTAGE_HYSTERESIS;
+    upper = mpp + BURST_VOLTAGE_HYSTERESIS;
+    lower = mpp - BURST_VOLTAGE_HYSTERESIS;
+
+    if (charger_burstState == charger_burstPause)
+    {
+        // no burst above the CV limit, the pause then runs into BURST_PAUSE_MAX_MS
+        if (measurements->panelVoltage.v >= upper
+            && measurements->batteryVoltage.v <= charger_read_target_voltage())
+        {
+            // duty cycle for the MPP voltage: duty = batteryVoltage * PWM_TOP / mpp
+            duty = ((uint32_t)measurements->batteryVoltage.v * PWM_HIGH_F_TOP) / mpp;
+            if (duty > PWM_HIGH_F_MAX)
+                duty = PWM_HIGH_F_MAX;
+            if (duty < PWM_HIGH_F_MIN)
+                duty = PWM_HIGH_F_MIN;
+            // set the duty cycle before the timer and the MOSFET driver start, like startCharging() does
+            pwm_set(duty);
+            pwm_0deg_enable(pwm_frequencyHigh);
+            charger_burstState = charger_burstOn;
+            charger_burstTick = tick;
+        }
+        else if ((uint16_t)(tick - charger_burstTick) >= BURST_PAUSE_MAX_MS)
+            // too dark even for bursts
+            stopCharging();
+    }
+    else
+    {
+        if (measurements->panelVoltage.v <= lower)
+        {
+            pwm_0deg_disable();
+            charger_burstState = charger_burstPause;
+            charger_burstTick = tick;
+        }
+        else if ((uint16_t)(tick - charger_burstTick) >= BURST_ON_MAX_MS)
+            // the panel supplies enough for continuous operation again: keep switching, the trackers take over
+            charger_burstState = charger_burstOff;
+    }
+}
+
+
 void stopCharging(void)
 {
-    chargerStatus &= ~chargerStatus_charging;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        chargerStatus &= ~chargerStatus_charging;
+    }
+    regulator_release();
+    charger_burstState = charger_burstOff;
     pwm = 0;
     pwm_0deg_disable();
     pwm_180deg_disable();
@@ -105,19 +295,27 @@ inline chargerStatus_t getChargerStatus(void){
 }
 
 inline void setOvertemperature1(void){
-	chargerStatus |= chargerStatus_overtemperature1;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		chargerStatus |= chargerStatus_overtemperature1;
+	}
 }
 
 inline void clearOvertemperature1(void){
-	chargerStatus &= !chargerStatus_overtemperature1;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		chargerStatus &= ~chargerStatus_overtemperature1;
+	}
 }
 
 inline void setOvertemperature2(void){
-	chargerStatus |= chargerStatus_overtemperature2;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		chargerStatus |= chargerStatus_overtemperature2;
+	}
 }
 
 inline void clearOvertemperature2(void){
-	chargerStatus &= !chargerStatus_overtemperature2;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		chargerStatus &= ~chargerStatus_overtemperature2;
+	}
 }
 
 inline uint8_t isOvertemperature1(void){
@@ -128,6 +326,10 @@ inline uint8_t isOvertemperature2(void){
 	return(chargerStatus & chargerStatus_overtemperature2);
 }
 
+inline uint8_t isFault(void){
+	return(chargerStatus & (chargerStatus_overcurrent | chargerStatus_overvoltage));
+}
+
 /*****************************************************************************
  *  Charger state machine
 
@@ -152,7 +354,7 @@ inline uint8_t isOvertemperature2(void){
 
  */
 
-void charger_update(measurements_t * measurements) {
+void charger_update(const measurements_t * measurements) {
 
     //printf("_time_state_change = %d, time = %d, v_bat = %f, i_bat = %f\n", _time_state_changed, datetime_getS(), battery_voltage, battery_current);
 #ifdef USE_LOAD_SWITCH
@@ -11,11 +11,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include "datetime.h"
+#include "scheduler.h"
 
 
 // Local counters; access them 
 volatile uint16_t datetime_ms = 0;  // [milliseconds] 
 volatile uint32_t datetime_s = 0;   // [seconds]
+volatile uint16_t datetime_tick = 0; // [milliseconds] free running, not affected by datetime_set()
 
 
 // for AVR FAT32
@@ -26,6 +28,9 @@ volatile uint8_t TimingDelay = 0;           // decrement every 10ms (if >0)
 ISR(TIMER1_COMPA_vect)
 {
     datetime_ms += TIME_INTERVAL_MS;
+    datetime_tick += TIME_INTERVAL_MS;
+    // release the due tasks of the main loop
+    scheduler_tick(datetime_tick);
     if (datetime_ms >= 1000)
     {
         datetime_ms -= 1000;
@@ -56,6 +61,18 @@ void datetime_init(void)
 }
 
 
+// Keep the 2 ms time base at a CPU clock of F_CPU >> shift. Call with interrupts disabled, right after the clock
+// prescaler was changed.
+void datetime_setClockShift(uint8_t shift)
+{
+    uint16_t ocr = ((TIME_TIMER1_OCR1A + 1) >> shift) - 1;
+
+    // continue the running tick at the same fraction
+    TCNT1 = (uint32_t)TCNT1 * (ocr + 1) / (OCR1A + 1);
+    OCR1A = ocr;
+}
+
+
 // Set timestamp
 void datetime_set(uint32_t seconds)
 {
@@ -91,6 +108,19 @@ uint16_t datetime_getMs(void)
 }
 
 
+// Returns a free running millisecond counter. It wraps around after 65.536 s, so only use it for intervals:
+// (uint16_t)(datetime_getTick() - start) >= interval
+uint16_t datetime_getTick(void)
+{
+    uint16_t tick;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        tick = datetime_tick;
+    }
+    return tick;
+}
+
+
 // Returns time as float
 float datetime_getAsFloat(void)
 {
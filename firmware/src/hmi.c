@@ -127,6 +127,10 @@ void showState(chargerStatus_t chargerStatus){
 		//yes, append state "hot"
 		strcat(buffer,"hot ");
 	}
+	//check if the fast overcurrent/overvoltage protection shut down the buck stages
+	else if(chargerStatus & (chargerStatus_overcurrent | chargerStatus_overvoltage)){
+		strcat(buffer,"trip");
+	}
 	else {
 		//show charger state
 		switch (chargerStatus & 0x03){
@@ -175,7 +179,7 @@ void showState(chargerStatus_t chargerStatus){
     sei();
 }
 
-void showProcessValues(measurements_t measurements) {
+void showProcessValues(const measurements_t *measurements) {
 	//char buffer[15];
 
     //disable interrupts
@@ -186,16 +190,16 @@ void showProcessValues(measurements_t measurements) {
     sei();
 
     //display battery voltage and charge current in line 1
-    showVoltageAndCurrent(measurements.batteryVoltage.v, measurements.chargeCurrent.v);
+    showVoltageAndCurrent(measurements->batteryVoltage.v, measurements->chargeCurrent.v);
 
     //show heatsink or output capacitor temperature, whichever is higher
-    if(measurements.temperature1.v > measurements.temperature2.v) {
+    if(measurements->temperature1.v > measurements->temperature2.v) {
 		//display the heat sink temperature
-		showTemperature(measurements.temperature1.v);
+		showTemperature(measurements->temperature1.v);
     }
 	else{
 		//display the output capacitor temperature
-		showTemperature(measurements.temperature2.v);
+		showTemperature(measurements->temperature2.v);
 	};
 
 	// disable interrupts
@@ -206,7 +210,7 @@ void showProcessValues(measurements_t measurements) {
     sei();
 
     //show panel voltage and current in line 2
-    showVoltageAndCurrent(measurements.panelVoltage.v, measurements.panelCurrent.v);
+    showVoltageAndCurrent(measurements->panelVoltage.v, measurements->panelCurrent.v);
 
     //show the charger's state
     showState(getChargerStatus());
@@ -215,7 +219,7 @@ void showProcessValues(measurements_t measurements) {
 /*
  * tell user that the SLACC went to sleep to save power while there is insufficient solar power output.
  */
-void showSleepMessage(measurements_t measurements){
+void showSleepMessage(const measurements_t *measurements){
     char bufferValue[15];
     char buffer[15];
     char outLine[15];
@@ -233,10 +237,10 @@ void showSleepMessage(measurements_t measurements){
     sei();
 
     //check if voltage is not zero.
-    if(measurements.batteryVoltage.v != 0){
+    if(measurements->batteryVoltage.v != 0){
 
 		//convert unsigned int voltage to ascii string bufferValue, use radix 10
-		utoa(measurements.batteryVoltage.v, bufferValue, 10);
+		utoa(measurements->batteryVoltage.v, bufferValue, 10);
 
 		// pad string to given length with spaces on left side
 		strpad(outLine, bufferValue , 5, ' ', 0);
@@ -252,10 +256,10 @@ void showSleepMessage(measurements_t measurements){
     };
 
 	//check if voltage is not zero.
-	if(measurements.panelVoltage.v != 0){
+	if(measurements->panelVoltage.v != 0){
 
 		//convert unsigned int voltage to ascii string bufferValue, use radix 10
-		utoa(measurements.panelVoltage.v, bufferValue, 10);
+		utoa(measurements->panelVoltage.v, bufferValue, 10);
 
 		// pad string to given length with spaces on left side
 		strpad(buffer, bufferValue , 5, ' ', 0);
@@ -278,7 +282,7 @@ void showSleepMessage(measurements_t measurements){
 	sei();
 
 	//show temperature
-	showTemperature(measurements.temperature1.v);
+	showTemperature(measurements->temperature1.v);
 
 	//disable interrupts
 	cli();
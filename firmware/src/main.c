@@ -23,8 +23,13 @@
 #include "datetime.h"
 #include "pwm.h"
 #include "measurement.h"
+#ifdef MEASUREMENT_PROFILE
+#include "measurement_profile.h"
+#endif
 #include "ST7032-master/ST7032.h"
 #include "hmi.h"
+#include "regulator.h"
+#include "scheduler.h"
 
 /*
 SLACC - Solar lead acid charge controller firmware
@@ -33,8 +38,6 @@ Frank Bättermann (frank.baettermann@ich-war-hier.de)
 fixes and optimizations by Dipl.-Ing. Jochen Menzel in July 2017
 mppt- and charger code from libre solar, adapted and included here by Dipl.-Ing. Jochen Menzel in December 2018
 
-TODO: On the fly frequency switching not implemented, yet!
-
 Fuse settings:
 efuse: 0xFC
 hfuse: 0xDF
@@ -55,6 +58,8 @@ TODO in next HW revision:
 */
 
 #define DEBUG_UART
+// send one line of telemetry per TELEMETRY_UPDATE_INTERVAL_MS, keeps the USART powered
+//#define TELEMETRY_UART
 
 #ifdef DEBUG_UART
 	#define DEBUG_static(z) uart_puts_P(PSTR(z));
@@ -63,11 +68,174 @@ TODO in next HW revision:
 
 ChargingProfile profile;
 
-int main(void)
+// indices into the task table, in order of priority
+enum
+{
+    task_indexMeasurement = 0,
+    task_indexMppt,
+    task_indexCharger,
+    task_indexThermal,
+    task_indexHmi,
+#ifdef TELEMETRY_UART
+    task_indexTelemetry,
+#endif
+    task_count
+};
+
+static void task_measurement(void);
+static void task_mppt(void);
+static void task_charger(void);
+static void task_thermal(void);
+static void task_hmi(void);
+#ifdef TELEMETRY_UART
+static void task_telemetry(void);
+#endif
+
+// run, period [ms], phase [ms], deadline [ms]. The phases keep the slower tasks off the same tick.
+static const scheduler_task_t tasks[task_count] =
+{
+    {task_measurement,  TIME_INTERVAL_MS,               0,  TIME_INTERVAL_MS},
+    {task_mppt,         MPPT_UPDATE_INTERVAL_MS,        4,  10},
+    {task_charger,      CHARGER_UPDATE_INTERVAL_MS,     10, 20},
+    {task_thermal,      THERMAL_UPDATE_INTERVAL_MS,     14, 20},
+    {task_hmi,          HMI_UPDATE_INTERVAL_MS,         6,  100},
+#ifdef TELEMETRY_UART
+    {task_telemetry,    TELEMETRY_UPDATE_INTERVAL_MS,   18, 100},
+#endif
+};
+
+
+// evaluate the background ADC scan (new results approx. every 3.5 ms) and run the fast control loops on them
+static void task_measurement(void)
+{
+    // channels with a new sample since the last regulator step
+    static uint8_t fresh = 0;
+    const uint8_t regulated = (1 << measurement_batteryVoltage) | (1 << measurement_chargeCurrent);
+    uint8_t updated = measure();
+
+    if (!updated)
+        return;
+    fresh |= updated;
+    const measurements_t *measurements = measurement_getSnapshot();
+
+    // the fast trip already shut down the buck stages, finish stopping the charger
+    if (isFault() && isCharging())
+        stopCharging();
+
+    // hold the CV/CC limits once per scan round, when both regulated values are fresh. The MPP tracker pauses
+    // meanwhile.
+    if ((fresh & regulated) == regulated)
+    {
+        fresh &= ~regulated;
+        if (isCharging() && !charger_isBursting())
+            regulator_update(measurements);
+    }
+    // light load: switch the 0° stage in bursts
+    charger_burst(measurements);
+}
+
+
+static void task_mppt(void)
+{
+    const measurements_t *measurements = measurement_getSnapshot();
+
+    update_mppt(measurements, &profile);
+    charger_selectFrequency(measurements);
+    charger_shedPhases(measurements);
+}
+
+
+// the charger state machine counts in seconds
+static void task_charger(void)
+{
+    charger_update(measurement_getSnapshot());
+}
+
+
+// overtemperature detection and cooling fan
+static void task_thermal(void)
+{
+    const measurements_t *measurements = measurement_getSnapshot();
+
+    // Detect overtemperatures
+    if (measurements->temperature1.v != UINT16_MAX && measurements->temperature1.v >= TEMP1_SHUTDOWN)
+        setOvertemperature1();
+    if (measurements->temperature2.v != UINT16_MAX && measurements->temperature2.v >= TEMP2_SHUTDOWN)
+        setOvertemperature2();
+
+    //check if we need to turn on the cooling fan
+    if ((measurements->temperature1.v >= TEMP1_FAN_ON) || ((measurements->temperature2.v >= TEMP2_FAN_ON))){
+        fan_on();
+    }
+    else
+        //check if we can turn off the cooling fan, again
+        if ((measurements->temperature1.v <= TEMP1_FAN_OFF) && ((measurements->temperature2.v <= TEMP2_FAN_OFF))){
+            fan_off();
+        };
+}
+
+
+//show stuff on display
+static void task_hmi(void)
 {
-	uint16_t countToDisplayUpdate = 0;
-    uint16_t last_second = 0;
+    showProcessValues(measurement_getSnapshot());
+}
+
+
+#ifdef TELEMETRY_UART
+// one line per call: tick;panel mV;panel mA;battery mV;battery mA;pwm (fine);status;overruns of all tasks;
+// idle time [%];estimated current saved by idle sleep [uA];energy lost to global sweeps since power-up [J]
+// with MEASUREMENT_PROFILE (measurement.h) additionally: cycles fixed-point;cycles former 64 bit computation
+static void task_telemetry(void)
+{
+    const measurements_t *measurements = measurement_getSnapshot();
+    char buffer[11];
+    uint16_t overruns = 0;
+    uint8_t i;
+
+    // the baud rate is only right at the full clock
+    if (clock_getShift())
+        return;
+
+    for (i = 0; i < task_count; i++)
+        overruns += scheduler_getOverruns(i);
 
+    uart_puts(utoa(datetime_getTick(), buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(measurements->panelVoltage.v, buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(measurements->panelCurrent.v, buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(measurements->batteryVoltage.v, buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(measurements->chargeCurrent.v, buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(pwm_getFine(), buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(getChargerStatus(), buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(overruns, buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(getIdlePercent(), buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(getIdleSavedCurrent(), buffer, 10));
+    uart_putc(';');
+    uart_puts(ultoa(mppt_getSweepLoss(), buffer, 10));
+#ifdef MEASUREMENT_PROFILE
+    uint16_t fixedPoint, reference;
+    measurement_getCycles(&fixedPoint, &reference);
+    uart_putc(';');
+    uart_puts(utoa(fixedPoint, buffer, 10));
+    uart_putc(';');
+    uart_puts(utoa(reference, buffer, 10));
+#endif
+    uart_putc('\n');
+}
+#endif
+
+
+int main(void)
+{
     // initialization
 	PTC_ADCref_init();
     PTC_ADCref_on();
@@ -76,14 +244,21 @@ int main(void)
     pwm_init();
     datetime_init();
     analog_comparator_disable();
-    adc_init(adc_voltageReferenceAref, adc_adjustResultRight, adc_interruptDisabled, adc_autoTriggerDisabled,\
-    		 adc_autoTriggerSourceFreeRunning);
+    adc_init(adc_voltageReferenceAref, adc_adjustResultRight, adc_interruptEnabled, adc_autoTriggerEnabled,\
+    		 adc_autoTriggerSourceTimer1CompareB);
     adc_enable();
-	#ifdef DEBUG_UART
+    // start the background ADC scan, results are evaluated by measure()
+    measurement_init();
+	#if defined(DEBUG_UART) || defined(TELEMETRY_UART)
     	uart_init();
 	#endif
     // disable unneeded peripherals
-    power_twi_spi_usart_disable();
+	#ifdef TELEMETRY_UART
+    	power_twi_disable();
+    	power_spi_disable();
+	#else
+    	power_twi_spi_usart_disable();
+	#endif
 
     /* initialize the charger profile */
     profile_init(&profile);
@@ -106,56 +281,39 @@ int main(void)
     ST7032setContrast(5);
     _delay_us(30);
 
-    // main loop
-    for (;;){
-        measure();
-
-        // Detect overtemperatures
-        if (measurements.temperature1.v != UINT16_MAX && measurements.temperature1.v >= TEMP1_SHUTDOWN)
-        	setOvertemperature1();
-        if (measurements.temperature2.v != UINT16_MAX && measurements.temperature2.v >= TEMP2_SHUTDOWN)
-            setOvertemperature2();
+    // learn the zero offsets of the current sensors while the buck stages are still off
+    measurement_autoZero();
 
-      	// update MPPT every 1000 ms
-        if(datetime_getS() - last_second >= 1){
-        	last_second = datetime_getS();
+    // from now on the time base releases the tasks
+    scheduler_init(tasks, task_count);
 
-        	/* update the charger state machine */
-        	charger_update(&measurements);
+    // main loop
+    for (;;){
+        //run the released tasks; if there were none, sleep until the next one is released
+        if (!scheduler_run())
+        	goToIdle();
 
-        	update_mppt( &measurements, &profile);
-        }
+        //the buck stages are off: run at the reduced clock until startCharging()
+        if (!isCharging())
+        	clock_slow();
 
 	    //check if we stopped charging for more than 15s and want to go to power-save sleep
 	    if (datetime_getS() >= 15) {
 	    	//check if we are still not charging, again.
 	    	if (!isCharging()){
+	    		const measurements_t *measurements = measurement_getSnapshot();
 	    		//show user that we went to sleep.
 	    		showSleepMessage(measurements);
-	    		//shut down any ongoing stuff and go to sleep for 8s.
-	    		goToSleep();
+	    		//the buck stages are off: re-learn the zero offsets of the current sensors
+	    		measurement_autoZero();
+	    		//shut down any ongoing stuff and go to sleep, longer the longer it stays dark.
+	    		goToSleep(measurements->panelVoltage.v < measurements->batteryVoltage.v);
+	    		//the time base stood still during sleep: check the panel right now
+	    		scheduler_release(task_indexMeasurement);
+	    		scheduler_release(task_indexCharger);
+	    		scheduler_release(task_indexMppt);
 			}
 		}
-
-	    //check if we need to turn on the cooling fan
-	    if ((measurements.temperature1.v >= TEMP1_FAN_ON) || ((measurements.temperature2.v >= TEMP2_FAN_ON))){
-	    	fan_on();
-	    }
-	    else
-			//check if we can turn off the cooling fan, again
-			if ((measurements.temperature1.v <= TEMP1_FAN_OFF) && ((measurements.temperature2.v <= TEMP2_FAN_OFF))){
-				fan_off();
-			};
-
-        //check if 500 ms have expired since the last time we updated the process values
-        if(countToDisplayUpdate == 10){
-        	//show stuff on display
-        	showProcessValues(measurements);
-        	//clear counter
-        	countToDisplayUpdate = 0;
-        }
-        else
-        	countToDisplayUpdate++;
     }
     
 	return 0;
@@ -7,90 +7,232 @@
 #include "adc.h"
 #include "linearize.h"
 #include "measurement.h"
+#ifdef MEASUREMENT_PROFILE
+#include "measurement_profile.h"
+#endif
 
 
-// struct that saves all measurements
-measurements_t measurements;
+// double buffer of all measurements: measurementBuffer[measurementSequence & 1] is the published set
+static measurements_t measurementBuffer[2];
+static volatile uint8_t measurementSequence = 0;
 
+// 4095 * 2^16 / PTC supply, updated whenever the PTC supply is measured (approx. once per second)
+static uint32_t measurementPTCreciprocal;
 
-void measure(void)
+// zero offsets of the current channels [12 bit counts]
+static uint16_t measurementOffsetPanelCurrent = MEASUREMENT_PANEL_CURRENT_OFFSET_DEFAULT;
+static uint16_t measurementOffsetChargeCurrent = MEASUREMENT_CHARGE_CURRENT_OFFSET_DEFAULT;
+
+
+
+/*
+ * descriptor table of the background ADC scan, indexed by measurement_channel_t.
+ * Currents and voltages are visited in every scan round with 8 samples each (4 channels * 8 * 104 us = approx.
+ * 3.3 ms per round), synchronized to the buck PWM. Their filters average over 16 samples, i.e. 2 rounds.
+ * The PTC supply and the temperatures only change slowly: they are visited in every 250th round only, i.e.
+ * approx. once per second, and filtered over 4 visits.
+ */
+static const adc_scanChannel measurementChannels[measurement_count] =
+{
+    // channel, samples, shift, period, sync
+    {0, 16, 6, 250, 0},   // PTC supply
+    {1,  8, 4,   1, 1},   // panel current
+    {2,  8, 4,   1, 1},   // panel voltage
+    {4,  8, 4,   1, 1},   // battery voltage
+    {5,  8, 4,   1, 1},   // charge current
+    {6, 16, 6, 250, 0},   // temperature 1
+    {7, 16, 6, 250, 0}    // temperature 2
+};
+
+
+void measurement_init(void)
+{
+    adc_scanInit(measurementChannels, measurement_count);
+    // sample currents and voltages in the middle of the on-time, away from the switching edges of both stages
+    adc_scanSetSyncPhase(adc_syncPhaseMidOn);
+    adc_scanGetUpdated(); // discard stale flags
+    adc_scanStart();
+}
+
+
+// subtract a zero offset from an ADC result without wrapping below 0
+static inline uint16_t measurement_removeOffset(uint16_t adc, uint16_t offset)
+{
+    return (adc > offset) ? adc - offset : 0;
+}
+
+
+/*
+ * returns x / 10000 for x < 5 * 10^8 without a division: multiply by 2^26 / 10000 = 6710.9 (rounded up), then correct
+ * the estimate by one if necessary. approx. 60 cycles instead of approx. 650 for __udivmodsi4.
+ */
+static inline uint16_t measurement_divide10000(uint32_t x)
 {
-    ADCAVG_SUM_TYPE adcSum;
-    uint32_t PTCcorrection;
+    uint16_t quotient = (uint16_t)(((x >> 10) * 6711UL) >> 16);
+    uint32_t product = (uint32_t)quotient * 10000UL;
+
+    if (product > x)
+        quotient--;
+    else if (x - product >= 10000UL)
+        quotient++;
+    return quotient;
+}
+
+
+/*
+ * correct a KTY81 reading for a PTC halfbridge supply voltage that is unequal to 5.00 V: adc * 4095 / PTC supply,
+ * computed with the reciprocal of the PTC supply and corrected by one to the exact quotient.
+ */
+static inline uint16_t measurement_correctPTC(uint16_t adc, uint16_t supply)
+{
+    uint32_t quotient;
+    uint32_t product;
+
+    if (measurementPTCreciprocal == 0)
+        return 4095; // PTC supply missing: report an open sensor
+    quotient = ((uint32_t)adc * measurementPTCreciprocal) >> 16;
+    product = quotient * supply;
+    if ((uint32_t)adc * 4095 - product >= supply)
+        quotient++;
+    return (uint16_t)quotient;
+}
+
+
+/*
+ * compute the powers and the efficiency. [mV] * [mA] stays below 2.1 * 10^8 for both sides (approx. 47 V * 4.3 A and
+ * 16 V * 10.4 A at full scale of the ADC), so 32 bit are sufficient.
+ * The efficiency keeps a true division, 32 by 16 bit. Its divisor, the panel power, changes with every panel update,
+ * so a reciprocal would need the same division on every update plus the multiply and the correction step.
+ */
+void measurement_derive(measurements_t *m)
+{
+    uint32_t chargePowerPrecise = (uint32_t)m->batteryVoltage.v * (uint32_t)m->chargeCurrent.v;
+    m->panelPower = measurement_divide10000((uint32_t)m->panelVoltage.v * (uint32_t)m->panelCurrent.v);
+    m->chargePower = measurement_divide10000(chargePowerPrecise);
+
+    if (m->panelPower > m->chargePower)
+        m->efficiency = (uint16_t)(chargePowerPrecise / m->panelPower);
+    else
+        m->efficiency = UINT16_MAX; // more than 100% efficiency would not make sense
+}
+
+
+uint8_t measure(void)
+{
+    uint8_t updated = adc_scanGetUpdated();
+
+    // nothing to do until the scan engine completed another channel
+    if (!updated)
+        return 0;
+
+    // fill the unpublished buffer, starting from the published values so channels without new results keep theirs
+    measurements_t *m = &measurementBuffer[(measurementSequence + 1) & 1];
+    *m = measurementBuffer[measurementSequence & 1];
 
     // ADC0 = temperature 3
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(0);
-    measurements.PTCsupply.adc = adcSum / ADCAVG_SAMPLES;
-//    measurements.PTCsupply.v = 5000 * measurements.PTCsupply.adc / 4096;
+    if (updated & (1 << measurement_PTCsupply))
+    {
+        m->PTCsupply.adc = adc_scanGetResult(measurement_PTCsupply);
+//        m->PTCsupply.v = 5000 * m->PTCsupply.adc / 4096;
+        // the only division of the PTC correction. Below 256 counts the sensors are not powered and the product
+        // adc * reciprocal would not fit into 32 bit.
+        if (m->PTCsupply.adc > 256)
+            measurementPTCreciprocal = (4095UL << 16) / m->PTCsupply.adc;
+        else
+            measurementPTCreciprocal = 0;
+    }
 
     // ADC1 = panel current
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(1);
-    measurements.panelCurrent.adc = adcSum / ADCAVG_SAMPLES;
-    measurements.panelCurrent.v = linearizeU16(&linListPanelCurrent, measurements.panelCurrent.adc);
-
+    if (updated & (1 << measurement_panelCurrent))
+    {
+        m->panelCurrent.adc = measurement_removeOffset(adc_scanGetResult(measurement_panelCurrent),
+                                                       measurementOffsetPanelCurrent);
+        m->panelCurrent.v = linearizeU16(&linListPanelCurrent, m->panelCurrent.adc);
+    }
 
     // ADC2 = panel voltage
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(2);
-    measurements.panelVoltage.adc= adcSum / ADCAVG_SAMPLES;
-    measurements.panelVoltage.v = linearizeU16(&linListPanelVoltage, measurements.panelVoltage.adc);
-   
+    if (updated & (1 << measurement_panelVoltage))
+    {
+        m->panelVoltage.adc = adc_scanGetResult(measurement_panelVoltage);
+        m->panelVoltage.v = linearizeU16(&linListPanelVoltage, m->panelVoltage.adc);
+    }
+
     // ADC4 = battery voltage
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(4);
-    measurements.batteryVoltage.adc = adcSum / ADCAVG_SAMPLES;
-    measurements.batteryVoltage.v = linearizeU16(&linListBattVoltage, measurements.batteryVoltage.adc);
-    
-    // ADC5 = charge current
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(5);
-    measurements.chargeCurrent.adc = adcSum / ADCAVG_SAMPLES;
-    measurements.chargeCurrent.v = linearizeU16(&linListChargeCurrent, measurements.chargeCurrent.adc);
-    /* correct offset */
-    #define CHARGECURRENTOFFSET 40 // offset in mA. Will be subtracted in measurement.c
-
-    if (measurements.chargeCurrent.v > CHARGECURRENTOFFSET) {
-    	measurements.chargeCurrent.v = measurements.chargeCurrent.v - CHARGECURRENTOFFSET;
+    if (updated & (1 << measurement_batteryVoltage))
+    {
+        m->batteryVoltage.adc = adc_scanGetResult(measurement_batteryVoltage);
+        m->batteryVoltage.v = linearizeU16(&linListBattVoltage, m->batteryVoltage.adc);
     }
-    else {
-    	measurements.chargeCurrent.v = 0;
+
+    // ADC5 = charge current
+    if (updated & (1 << measurement_chargeCurrent))
+    {
+        m->chargeCurrent.adc = measurement_removeOffset(adc_scanGetResult(measurement_chargeCurrent),
+                                                        measurementOffsetChargeCurrent);
+        m->chargeCurrent.v = linearizeU16(&linListChargeCurrent, m->chargeCurrent.adc);
     }
 
     // ADC6 = temperature 1
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(6);
-    measurements.temperature1.adc = adcSum / ADCAVG_SAMPLES;
     //correct for PTC halfbridge supply voltage that is unequal to 5.00 V
-    PTCcorrection = (long) measurements.temperature1.adc * (long)4095 / (long) measurements.PTCsupply.adc;
-    measurements.temperature1.adc = (uint16_t) PTCcorrection ;
-    measurements.temperature1.v = linearizeU16(&linListKty81210, measurements.temperature1.adc);
-    
+    if (updated & ((1 << measurement_temperature1) | (1 << measurement_PTCsupply)))
+    {
+        m->temperature1.adc = measurement_correctPTC(adc_scanGetResult(measurement_temperature1), m->PTCsupply.adc);
+        m->temperature1.v = linearizeU16(&linListKty81210, m->temperature1.adc);
+    }
+
     // ADC7 = temperature 2
-    adcSum = 0;
-    for (uint8_t i = 0; i < ADCAVG_SAMPLES; i++)
-        adcSum += adc_12BitConversion(7);
-    measurements.temperature2.adc = adcSum / ADCAVG_SAMPLES;
-    PTCcorrection = (long) measurements.temperature2.adc * (long)4095 / (long) measurements.PTCsupply.adc;
-    measurements.temperature2.adc = (uint16_t) PTCcorrection ;
-    measurements.temperature2.v = linearizeU16(&linListKty81210, measurements.temperature2.adc);
-    
-    // Compute values
-    uint64_t chargePowerPrecise = (uint32_t)measurements.batteryVoltage.v * (uint32_t)measurements.chargeCurrent.v;
-    measurements.panelPower = (uint16_t)((uint32_t)measurements.panelVoltage.v * (uint32_t)measurements.panelCurrent.v / 10000UL);
-    measurements.chargePower = (uint16_t)(chargePowerPrecise / (uint64_t)10000);
-    
-    if (measurements.panelPower > measurements.chargePower)
-        measurements.efficiency = (uint16_t)(chargePowerPrecise / measurements.panelPower);
-    else
-        measurements.efficiency = UINT16_MAX; // more than 100% efficiency would not make sense
+    if (updated & ((1 << measurement_temperature2) | (1 << measurement_PTCsupply)))
+    {
+        m->temperature2.adc = measurement_correctPTC(adc_scanGetResult(measurement_temperature2), m->PTCsupply.adc);
+        m->temperature2.v = linearizeU16(&linListKty81210, m->temperature2.adc);
+    }
+
+    // Compute values, only the voltage and current channels change them
+    if (updated & ((1 << measurement_panelVoltage) | (1 << measurement_panelCurrent)
+                 | (1 << measurement_batteryVoltage) | (1 << measurement_chargeCurrent)))
+    {
+#ifdef MEASUREMENT_PROFILE
+        measurement_profile(m);
+#endif
+        measurement_derive(m);
+    }
+
+    // publish the complete set with a single byte write
+    measurementSequence++;
+
+    return updated;
 }
 
 
+uint8_t measurement_autoZero(void)
+{
+    uint16_t panelCurrent;
+    uint16_t chargeCurrent;
+
+    // the current filters still hold readings from before the buck stages went off
+    for (uint8_t i = 0; i < MEASUREMENT_AUTOZERO_ROUNDS; i++)
+        adc_scanWait();
+    panelCurrent = adc_scanGetResult(measurement_panelCurrent);
+    chargeCurrent = adc_scanGetResult(measurement_chargeCurrent);
+
+    // a large reading means there is current flowing or a sensor is broken, do not learn from it
+    if (panelCurrent > MEASUREMENT_OFFSET_MAX || chargeCurrent > MEASUREMENT_OFFSET_MAX)
+        return 0;
+
+    // average over several calibrations: offset = 3/4 * offset + 1/4 * reading (rounded)
+    measurementOffsetPanelCurrent = (3 * measurementOffsetPanelCurrent + panelCurrent + 2) / 4;
+    measurementOffsetChargeCurrent = (3 * measurementOffsetChargeCurrent + chargeCurrent + 2) / 4;
+    return 1;
+}
+
+
+const measurements_t* measurement_getSnapshot(void)
+{
+    return &measurementBuffer[measurementSequence & 1];
+}
+
+
+uint8_t measurement_getSequence(void)
+{
+    return measurementSequence;
+}
@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2023 2023 Dipl.-Ing. Jochen Menzel (Jehdar@gmx.de)
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "measurement.h"
+
+#ifdef MEASUREMENT_PROFILE
+#include "measurement_profile.h"
+
+static uint16_t measurementCyclesFixedPoint;    // [CPU cycles] of measurement_derive()
+static uint16_t measurementCyclesReference;     // [CPU cycles] of measurement_deriveReference()
+
+
+// the computation measure() used before the fixed-point version, only kept for the cycle comparison
+static __attribute__((noinline)) void measurement_deriveReference(measurements_t *m)
+{
+    uint64_t chargePowerPrecise = (uint32_t)m->batteryVoltage.v * (uint32_t)m->chargeCurrent.v;
+    m->panelPower = (uint16_t)((uint32_t)m->panelVoltage.v * (uint32_t)m->panelCurrent.v / 10000UL);
+    m->chargePower = (uint16_t)(chargePowerPrecise / (uint64_t)10000);
+    if (m->panelPower > m->chargePower)
+        m->efficiency = (uint16_t)(chargePowerPrecise / m->panelPower);
+    else
+        m->efficiency = UINT16_MAX;
+}
+
+
+// CPU cycles since start, timer1 counts the CPU clock from 0 to OCR1A
+static inline uint16_t measurement_cyclesSince(uint16_t start)
+{
+    uint16_t now = TCNT1;
+
+    if (now < start)
+        now += OCR1A + 1;
+    return now - start;
+}
+
+
+// time both computations on a copy of the new set, so the published values are not touched
+void measurement_profile(const measurements_t *m)
+{
+    measurements_t copy;
+    uint16_t start;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        copy = *m;
+        start = TCNT1;
+        measurement_derive(&copy);
+        measurementCyclesFixedPoint = measurement_cyclesSince(start);
+
+        copy = *m;
+        start = TCNT1;
+        measurement_deriveReference(&copy);
+        measurementCyclesReference = measurement_cyclesSince(start);
+    }
+}
+
+
+void measurement_getCycles(uint16_t *fixedPoint, uint16_t *reference)
+{
+    *fixedPoint = measurementCyclesFixedPoint;
+    *reference = measurementCyclesReference;
+}
+#endif
@@ -8,15 +8,242 @@
 #include "charger.h"
 #include "pwm.h"
 #include "datetime.h"
+#include "regulator.h"
 
 uint32_t dcdc_power;    // stores previous output power
 uint8_t MPPT_direction_up = 0xFF;
+static uint8_t MPPT_step = MPPT_STEP_MIN;   // size of the last perturbation [fine pwm steps]
+static uint16_t MPPT_panelVoltage;          // panel voltage of the last update [mV]
+static uint16_t MPPT_panelCurrent;          // panel current of the last update [mA]
+static pwm_frequency_t MPPT_frequency = pwm_frequencyHigh; // pwm frequency setting of the last update
 
-void update_mppt(measurements_t * measurements, ChargingProfile * profile)
+// global sweep
+#define MPPT_SWEEP_IDLE         0xFF
+#define MPPT_SWEEP_UPDATES      ((uint32_t)MPPT_SWEEP_INTERVAL_S * 1000 / MPPT_UPDATE_INTERVAL_MS)
+static uint16_t MPPT_sweepCurve[MPPT_SWEEP_POINTS]; // panel power per point [W * 100]
+static uint8_t MPPT_sweepIndex = MPPT_SWEEP_IDLE;   // point being measured
+static uint8_t MPPT_sweepStep;                      // duty cycle distance between the points [pwm counts]
+static uint8_t MPPT_sweepStart;                     // duty cycle of the first point, the Voc end
+static uint16_t MPPT_sweepReturn;                   // duty cycle before the sweep, restored on abort [fine]
+static uint16_t MPPT_sweepReference;                // panel power before the sweep [W * 100]
+static uint32_t MPPT_sweepCountdown = MPPT_SWEEP_UPDATES;  // update_mppt() calls until the next sweep
+static uint8_t MPPT_sweepRequested = 0;             // mppt_requestSweep() was called
+static uint32_t MPPT_sweepLoss;                     // [W * 100 * ms] not yet converted into MPPT_sweepLossJ
+static uint32_t MPPT_sweepLossJ;                    // [J]
+static uint16_t MPPT_sweepHoldoff = 0;              // update_mppt() calls until a power drop may start a sweep
+
+// warm start
+static uint16_t MPPT_voc = 0;                                   // last open circuit voltage [mV]
+static uint8_t MPPT_vocFraction = MPPT_VOC_FRACTION_DEFAULT;    // MPP voltage / Voc [1/256]
+static uint8_t MPPT_vocLearn = 0;       // a sweep just moved to the MPP: learn the fraction from the next update
+
+// feed-forward
+static uint16_t MPPT_feedForwardVoltage = 0;        // battery voltage of the last correction [mV], 0: none yet
+
+
+/*
+ * scale the next perturbation from the power change caused by the last one.
+ */
+static uint8_t mppt_nextStep(uint32_t power_old, uint32_t power_new)
+{
+    uint32_t delta = (power_new > power_old) ? power_new - power_old : power_old - power_new;
+    // slope per pwm count = delta * PWM_DITHER_STEPS / MPPT_step, the result is converted to fine steps again
+    uint32_t step = (delta * PWM_DITHER_STEPS * PWM_DITHER_STEPS) / ((uint32_t)MPPT_step * MPPT_STEP_SCALE);
+
+    if (step < MPPT_STEP_MIN)
+        return MPPT_STEP_MIN;
+    if (step > MPPT_STEP_MAX)
+        return MPPT_STEP_MAX;
+    return (uint8_t)step;
+}
+
+
+/*
+ * one step of the incremental conductance tracker. Raising the duty cycle lowers the panel voltage.
+ */
+static void mppt_incrementalConductance(const measurements_t * measurements)
+{
+    int32_t dV = (int32_t)measurements->panelVoltage.v - MPPT_panelVoltage;
+    int32_t dI = (int32_t)measurements->panelCurrent.v - MPPT_panelCurrent;
+    int32_t slope;
+    int32_t tolerance;
+
+    if (dV > -MPPT_INC_COND_DV_MIN && dV < MPPT_INC_COND_DV_MIN)
+    {
+        // voltage unchanged: only the irradiance can have changed the current
+        if (dI >= MPPT_INC_COND_DI_MIN)
+            pwm_stepDown(); // more current: the MPP moved to a higher voltage
+        else if (dI <= -MPPT_INC_COND_DI_MIN)
+            pwm_stepUp();   // less current: the MPP moved to a lower voltage
+        return;
+    }
+
+    // slope = (I * dV + V * dI) * sign(dV) has the sign of dP/dV
+    slope = (int32_t)measurements->panelCurrent.v * dV + (int32_t)measurements->panelVoltage.v * dI;
+    if (dV < 0)
+    {
+        slope = -slope;
+        dV = -dV;
+    }
+    tolerance = ((int32_t)measurements->panelCurrent.v * dV) >> MPPT_INC_COND_TOLERANCE_SHIFT;
+
+    if (slope > tolerance)
+        pwm_stepDown();     // left of the MPP: raise the panel voltage
+    else if (slope < -tolerance)
+        pwm_stepUp();       // right of the MPP: lower the panel voltage
+    // else: at the MPP, hold the duty cycle
+}
+
+
+/*
+ * add the power that the current sweep point costs compared to the power before the sweep.
+ */
+static void mppt_sweepAccountLoss(uint16_t power)
+{
+    if (power < MPPT_sweepReference)
+        MPPT_sweepLoss += (uint32_t)(MPPT_sweepReference - power) * MPPT_UPDATE_INTERVAL_MS;
+    // 1 J = 100 * 1000 [W * 100 * ms]
+    while (MPPT_sweepLoss >= 100000UL)
+    {
+        MPPT_sweepLoss -= 100000UL;
+        MPPT_sweepLossJ++;
+    }
+}
+
+
+static void mppt_sweepBegin(uint16_t power)
+{
+    uint8_t range = pwm_getMax() - pwm_getMin();
+
+    MPPT_sweepReturn = pwm_getFine();
+    MPPT_sweepReference = power;
+    MPPT_sweepStart = pwm_getMin();
+    MPPT_sweepStep = (range + MPPT_SWEEP_POINTS - 2) / (MPPT_SWEEP_POINTS - 1); // round up to fit the buffer
+    if (MPPT_sweepStep < PWM_STEP)
+        MPPT_sweepStep = PWM_STEP;
+    MPPT_sweepIndex = 0;
+    MPPT_sweepRequested = 0;
+    pwm_set(MPPT_sweepStart);
+}
+
+
+/*
+ * leave the sweep at duty cycle value [fine pwm steps] and let the trackers start over from there.
+ */
+static void mppt_sweepEnd(uint16_t value)
+{
+    MPPT_sweepIndex = MPPT_SWEEP_IDLE;
+    MPPT_sweepCountdown = MPPT_SWEEP_UPDATES;
+    MPPT_sweepHoldoff = MPPT_SWEEP_DROP_HOLDOFF_UPDATES;
+    pwm_setFine(value);
+    MPPT_step = MPPT_STEP_MIN;
+    dcdc_power = 0;
+}
+
+
+/*
+ * record the power of the current sweep point and move on to the next one.
+ */
+static void mppt_sweep(const measurements_t * measurements)
+{
+    uint8_t best = 0;
+    uint8_t last = MPPT_sweepIndex;
+
+    MPPT_sweepCurve[MPPT_sweepIndex] = measurements->panelPower;
+    mppt_sweepAccountLoss(measurements->panelPower);
+
+    if (measurements->chargeCurrent.v >= charger_read_target_current()
+        || measurements->batteryVoltage.v >= charger_read_target_voltage())
+    {
+        // a CV/CC limit is reached: do not go further, and not back to this point either
+        if (last)
+            last--;
+    }
+    else if (MPPT_sweepIndex + 1 < MPPT_SWEEP_POINTS
+        && pwm_getMax() - MPPT_sweepStart >= (MPPT_sweepIndex + 1) * MPPT_sweepStep)
+    {
+        MPPT_sweepIndex++;
+        pwm_set(MPPT_sweepStart + MPPT_sweepIndex * MPPT_sweepStep);
+        return;
+    }
+
+    // sweep done: jump to the global maximum
+    for (uint8_t i = 1; i <= last; i++)
+        if (MPPT_sweepCurve[i] > MPPT_sweepCurve[best])
+            best = i;
+    mppt_sweepEnd(PWM_FINE(MPPT_sweepStart + best * MPPT_sweepStep));
+    MPPT_vocLearn = 1;
+}
+
+
+/*
+ * scale the duty cycle with the battery voltage change since the last correction. Returns 1 if it was corrected.
+ */
+static uint8_t mppt_feedForward(uint16_t batteryVoltage)
+{
+    uint16_t delta;
+
+    if (MPPT_feedForwardVoltage == 0)
+    {
+        MPPT_feedForwardVoltage = batteryVoltage;
+        return 0;
+    }
+    delta = (batteryVoltage > MPPT_feedForwardVoltage) ? batteryVoltage - MPPT_feedForwardVoltage
+                                                        : MPPT_feedForwardVoltage - batteryVoltage;
+    if (delta < MPPT_FEED_FORWARD_DEADBAND)
+        return 0;
+    pwm_setFine(((uint32_t)pwm_getFine() * batteryVoltage + (MPPT_feedForwardVoltage >> 1)) / MPPT_feedForwardVoltage);
+    MPPT_feedForwardVoltage = batteryVoltage;
+    return 1;
+}
+
+
+/*
+ * refine the Voc fraction from the panel voltage at the MPP found by a sweep.
+ */
+static void mppt_learnVocFraction(uint16_t panelVoltage)
+{
+    uint32_t fraction;
+
+    MPPT_vocLearn = 0;
+    if (MPPT_voc == 0)
+        return;
+    fraction = ((uint32_t)panelVoltage << 8) / MPPT_voc;
+    if (fraction < MPPT_VOC_FRACTION_MIN || fraction > MPPT_VOC_FRACTION_MAX)
+        return; // Voc is outdated or the sweep found a shaded maximum far from the usual one
+    MPPT_vocFraction = (3 * (uint16_t)MPPT_vocFraction + (uint16_t)fraction + 2) / 4;
+}
+
+
+uint16_t mppt_getStartVoltage(void)
+{
+    return (uint16_t)(((uint32_t)MPPT_voc * MPPT_vocFraction) >> 8);
+}
+
+
+void mppt_requestSweep(void)
+{
+    MPPT_sweepRequested = 1;
+}
+
+
+uint32_t mppt_getSweepLoss(void)
+{
+    return MPPT_sweepLossJ;
+}
+
+
+void update_mppt(const measurements_t * measurements, ChargingProfile * profile)
 {
     uint32_t dcdc_power_new = measurements->panelPower;
     //uint32_t dcdc_power_new = measurements->chargePower;
 
+    // the buck stages are off: the panel is open circuit
+    if (!isCharging())
+    	MPPT_voc = measurements->panelVoltage.v;
+    else if (MPPT_vocLearn && MPPT_sweepIndex == MPPT_SWEEP_IDLE)
+    	mppt_learnVocFraction(measurements->panelVoltage.v);
+
 //    if (dcdc_enabled() == false && charger_charging_enabled() == true
     if (!isCharging()
         && measurements->batteryVoltage.v < charger_read_target_voltage()
@@ -26,30 +253,81 @@ void update_mppt(measurements_t * measurements, ChargingProfile * profile)
     {
 //        serial.printf("MPPT start!\n");
     	startCharging();
+    	MPPT_sweepIndex = MPPT_SWEEP_IDLE;
+    	MPPT_vocLearn = 0;
+    	MPPT_sweepCountdown = MPPT_SWEEP_UPDATES;
+    	MPPT_feedForwardVoltage = 0;
     }
-    else if (isCharging() &&
+    else if (isCharging() && !charger_isBursting() && MPPT_sweepIndex == MPPT_SWEEP_IDLE &&
  //   		(measurements->panelVoltage.v <= measurements->batteryVoltage.v) &&
 			(measurements->panelCurrent.v < profile->charge_panel_current_min))
     {
         //serial.printf("MPPT stop!\n");
-        stopCharging();
+        // harvest the little energy in bursts, charger_burst() stops charging if even that fails
+        charger_startBurst();
+        MPPT_sweepIndex = MPPT_SWEEP_IDLE;
 
     }
     else if (isCharging()) {
+        // sub-count duty cycles only for the regulator and for the fine steps of perturb and observe
+        uint8_t dither = regulator_isActive();
+
+        // after a frequency switch the duty cycle has another scale: forget the last power and the sweep points
+        if (pwm_getFrequency() != MPPT_frequency) {
+        	MPPT_frequency = pwm_getFrequency();
+        	MPPT_sweepIndex = MPPT_SWEEP_IDLE;
+        	dcdc_power = 0;
+        }
 
-        if (measurements->batteryVoltage.v > charger_read_target_voltage()
-            || measurements->chargeCurrent.v > charger_read_target_current()
+        // the regulator controls the battery voltage itself, a sweep sets absolute duty cycles
+        if (regulator_isActive() || charger_isBursting() || MPPT_sweepIndex != MPPT_SWEEP_IDLE)
+        	MPPT_feedForwardVoltage = measurements->batteryVoltage.v;
+        else if (mppt_feedForward(measurements->batteryVoltage.v))
+        	// the power change of this update is caused by the correction, not by the last perturbation
+        	dcdc_power = 0;
+
+        // a sudden power drop (shading moving over the panel) may have left the tracker on a local maximum
+        if (dcdc_power > dcdc_power_new && MPPT_sweepHoldoff == 0
+            && dcdc_power - dcdc_power_new > (dcdc_power >> MPPT_SWEEP_DROP_SHIFT))
+        	mppt_requestSweep();
+
+        if (charger_isBursting()) {
+        	// charger_burst() switches the 0° stage, the tracker starts over when burst mode ends
+        	dcdc_power_new = 0;
+        }
+        else if (regulator_isActive()
             || isOvertemperature1()
 			|| isOvertemperature2())
         {
+            // a sweep would drive the current up again: go back to where it started
+            if (MPPT_sweepIndex != MPPT_SWEEP_IDLE)
+            	mppt_sweepEnd(MPPT_sweepReturn);
+            // the PI regulator holds the CV/CC limit. On overtemperature:
             // increase input voltage --> lower output voltage and decreased current
-			pwm_stepDown();
+            if (!regulator_isActive())
+            	pwm_stepDown();
+            // the tracker starts over from the duty cycle the regulator leaves behind
+            dcdc_power_new = 0;
+        }
+        else if (pwm_getFrequency() == pwm_frequencyMinimal) {
+        	// no MPPT in minimal frequency mode: return to the maximum duty cycle after a CV/CC reduction
+        	pwm_stepUpBy(PWM_DITHER_STEPS);
+        	dcdc_power_new = 0;
+        }
+        else if (MPPT_sweepIndex != MPPT_SWEEP_IDLE) {
+        	mppt_sweep(measurements);
+        	dcdc_power_new = 0;
+        }
+        else if ((MPPT_sweepRequested || (MPPT_SWEEP_INTERVAL_S && MPPT_sweepCountdown == 0))
+        		 && measurements->panelCurrent.v >= profile->mppt_panel_current_min) {
+        	mppt_sweepBegin(measurements->panelPower);
+        	dcdc_power_new = 0;
         }
         else if (measurements->panelCurrent.v < profile->mppt_panel_current_min) {
             // do not make use of MPPT because there seems to be little sun and we have veery low panel current.
 
         	/*
-			 * if pwm < PWM_TOP * battery voltage / panel voltage, we need to correct the duty cycle or we
+			 * if pwm < pwm_getTop() * battery voltage / panel voltage, we need to correct the duty cycle or we
 			 * will see current flow from the battery through the charger into the panel.
 			 * Check if charge current is approximately same as panel current. If not, increase PWM duty cycle.
 			 * We compare panel current against charge current + 10 mA because an active SLACC consumes 10 mA
@@ -59,15 +337,17 @@ void update_mppt(measurements_t * measurements, ChargingProfile * profile)
         		/*
         		 * additionally increase pwm duty cycle
         		 */
-        	    // Guess initial pwm setting: pwm = batteryVoltage * PWM_TOP / panelVoltage + offset
-        	    pwm = (uint16_t)(((uint32_t)measurements->batteryVoltage.v * PWM_TOP) / measurements->panelVoltage.v) + PWM_INIT_OFFSET;
-        	    if (pwm > PWM_MAX-4)
-        	    	pwm = PWM_MAX-4;
+        	    // Guess initial pwm setting: pwm = batteryVoltage * TOP / panelVoltage + offset (4 %)
+        	    uint16_t guess = (uint16_t)(((uint32_t)measurements->batteryVoltage.v * pwm_getTop()) / measurements->panelVoltage.v)
+        	    		+ pwm_getTop() * 4UL / 100;
+        	    if (guess > pwm_getMax() - 4)
+        	    	guess = pwm_getMax() - 4;
+        	    pwm = guess;
         	}
 
-        	//let PWM duty cycle drift towards PWM_MAX until it reaches 99.2% or the panel current
-        	//exceeds MPPT_CURRENT_MIN, again.
-        	if (pwm < PWM_MAX - 4){
+        	//let PWM duty cycle drift towards pwm_max until it reaches 99.2% or the panel current
+        	//exceeds mppt_panel_current_min, again.
+        	if (pwm < pwm_getMax() - 4){
 				pwm_stepUp();
 				//make sure that the MPPT algorithm decides towards rising PWM in the next iteration.
 				MPPT_direction_up = 0xFF;
@@ -79,22 +359,43 @@ void update_mppt(measurements_t * measurements, ChargingProfile * profile)
 				dcdc_power_new = 0;
         	}
         }
+        else if (profile->mppt_algorithm == mppt_algorithmIncrementalConductance) {
+        	mppt_incrementalConductance(measurements);
+        }
         else {
 
             // start MPPT
+            uint8_t step = (dcdc_power != 0) ? mppt_nextStep(dcdc_power, dcdc_power_new) : MPPT_STEP_MIN;
+            uint16_t pwm_old = pwm_getFine();
+            uint16_t pwm_new;
+
             if (dcdc_power > dcdc_power_new) {
 //                pwm_delta = -pwm_delta;
             	//toggle the direction for the next PWM change
             	MPPT_direction_up ^= 0xFF;
             }
+            dither = (step < PWM_DITHER_STEPS);
+            pwm_setDither(dither);
             if (MPPT_direction_up){
-            	pwm_stepUp();
+            	pwm_stepUpBy(step);
             }
             else {
-            	pwm_stepDown();
+            	pwm_stepDownBy(step);
             }
+            // remember the step that was actually applied, it is smaller at pwm_min/pwm_max
+            pwm_new = pwm_getFine();
+            MPPT_step = (pwm_new > pwm_old) ? pwm_new - pwm_old : pwm_old - pwm_new;
+            if (MPPT_step < MPPT_STEP_MIN)
+            	MPPT_step = MPPT_STEP_MIN;
         }
+        pwm_setDither(dither);
     }
 
+    if (MPPT_sweepCountdown)
+    	MPPT_sweepCountdown--;
+    if (MPPT_sweepHoldoff)
+    	MPPT_sweepHoldoff--;
     dcdc_power = dcdc_power_new;
+    MPPT_panelVoltage = measurements->panelVoltage.v;
+    MPPT_panelCurrent = measurements->panelCurrent.v;
 }
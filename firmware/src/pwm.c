@@ -7,12 +7,19 @@
 //#include <avr/io.h>
 #include <stdint.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 uint8_t pwm;
 
 uint8_t pwm_min;
 uint8_t pwm_max;
 
+static uint8_t pwm_frac = 0;        // fraction of the duty cycle below one timer count [1/PWM_DITHER_STEPS]
+static uint8_t pwm_ditherError = 0; // accumulated error of the sigma-delta modulator
+static uint8_t pwm_ditherEnabled = 0; // pwm_setFine() keeps the fraction, see pwm_setDither()
+
+static pwm_frequency_t pwm_frequencyActive = pwm_frequencyHigh; // frequency setting of the running 0 deg stage
+
 void pwm_init(void)
 {
     // configure shutdown of 0� buck stage as output
@@ -46,50 +53,131 @@ void pwm_init(void)
 // Insecure! Do not use directly (does not ensure bootstrapping)
 void pwm_set(uint8_t value)
 {
-    if (value > PWM_TOP)
-        value = PWM_TOP;
-    pwm = value;
-    OCR0B = OCR2B = value;
+    if (value > pwm_getTop())
+        value = pwm_getTop();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        pwm = value;
+        pwm_frac = 0;
+        TIMSK0 &= ~timer0_Interrupt_Overflow;
+        OCR0B = OCR2B = value;
+    }
 }
 
 
-// returns 1 if pwm could not be increased
-uint8_t pwm_stepUp(void)
+// set the duty cycle in fine steps, limited to pwm_min..pwm_max. Rounded to whole counts while dithering is disabled.
+void pwm_setFine(uint16_t value)
 {
-    uint8_t ret = 0;
-    if (pwm >= pwm_max)
+    if (!pwm_ditherEnabled)
+        value = (value + PWM_DITHER_STEPS / 2) & ~(PWM_DITHER_STEPS - 1);
+    if (value > PWM_FINE(pwm_max))
+        value = PWM_FINE(pwm_max);
+    if (value < PWM_FINE(pwm_min))
+        value = PWM_FINE(pwm_min);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        pwm = pwm_max;
-        ret = 1;
+        pwm = value >> PWM_DITHER_BITS;
+        pwm_frac = value & (PWM_DITHER_STEPS - 1);
+        // the overflow interrupt adds the fraction from the next PWM period on, it is only needed for a fraction
+        if (pwm_frac)
+            TIMSK0 |= timer0_Interrupt_Overflow;
+        else
+            TIMSK0 &= ~timer0_Interrupt_Overflow;
+        OCR0B = OCR2B = pwm;
     }
-    else if (pwm_max - pwm >= PWM_STEP)
-        pwm += PWM_STEP;
-    else
-        pwm = pwm_max;
-        
-    OCR0B = OCR2B = pwm;
-    
-    return ret;
 }
 
 
-// returns 1 if pwm could not be decreased
+// allow or forbid a fraction below one count. Forbidding it rounds the present duty cycle to whole counts.
+void pwm_setDither(uint8_t enable)
+{
+    if (enable == pwm_ditherEnabled)
+        return;
+    pwm_ditherEnabled = enable;
+    if (!enable && pwm_frac)
+        pwm_setFine(pwm_getFine());
+}
+
+
+// returns non-zero while the overflow interrupt dithers the duty cycle
+uint8_t pwm_isDithering(void)
+{
+    return TIMSK0 & timer0_Interrupt_Overflow;
+}
+
+
+// returns the duty cycle in fine steps
+uint16_t pwm_getFine(void)
+{
+    uint16_t value;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        value = PWM_FINE(pwm) | pwm_frac;
+    }
+    return value;
+}
+
+
+// increase pwm by step fine steps, but not above pwm_max. returns 1 if pwm could not be increased
+uint8_t pwm_stepUpBy(uint8_t step)
+{
+    uint16_t value = pwm_getFine();
+
+    if (value >= PWM_FINE(pwm_max))
+    {
+        pwm_setFine(PWM_FINE(pwm_max));
+        return 1;
+    }
+    pwm_setFine(value + step);
+    return 0;
+}
+
+
+// decrease pwm by step fine steps, but not below pwm_min. returns 1 if pwm could not be decreased
+uint8_t pwm_stepDownBy(uint8_t step)
+{
+    uint16_t value = pwm_getFine();
+
+    if (value <= PWM_FINE(pwm_min))
+    {
+        pwm_setFine(PWM_FINE(pwm_min));
+        return 1;
+    }
+    pwm_setFine((value - PWM_FINE(pwm_min) > step) ? value - step : PWM_FINE(pwm_min));
+    return 0;
+}
+
+
+// increase pwm by PWM_STEP timer counts. returns 1 if pwm could not be increased
+uint8_t pwm_stepUp(void)
+{
+    return pwm_stepUpBy(PWM_FINE(PWM_STEP));
+}
+
+
+// decrease pwm by PWM_STEP timer counts. returns 1 if pwm could not be decreased
 uint8_t pwm_stepDown(void)
 {
-    uint8_t ret = 0;
-    if (pwm <= pwm_min)
+    return pwm_stepDownBy(PWM_FINE(PWM_STEP));
+}
+
+
+/*
+ * timer0 reached TOP: first order sigma-delta modulation of the fraction onto OCR0B/OCR2B. Both registers are double
+ * buffered and taken over at BOTTOM, which has already passed when the ISR writes them, so the new value applies to
+ * the period after the next one. Timer 2 runs half a period behind and takes it over half a period earlier.
+ */
+ISR(TIMER0_OVF_vect)
+{
+    uint8_t value = pwm;
+
+    pwm_ditherError += pwm_frac;
+    if (pwm_ditherError >= PWM_DITHER_STEPS)
     {
-        pwm = pwm_min;
-        ret = 1;
+        pwm_ditherError -= PWM_DITHER_STEPS;
+        value++;
     }
-    else if (pwm - pwm_min >= PWM_STEP)
-        pwm -= PWM_STEP;
-    else
-        pwm = pwm_min;
-        
-    OCR0B = OCR2B = pwm;
-    
-    return ret;
+    OCR0B = OCR2B = value;
 }
 
 uint8_t pwm_get(void)
@@ -97,6 +185,141 @@ uint8_t pwm_get(void)
     return pwm;
 }
 
+// lowest duty cycle of the current frequency setting
+uint8_t pwm_getMin(void)
+{
+    return pwm_min;
+}
+
+// highest duty cycle of the current frequency setting that keeps the bootstrap working
+uint8_t pwm_getMax(void)
+{
+    return pwm_max;
+}
+
+// frequency setting of the 0 deg stage, the 180 deg stage has to be started with the same one
+pwm_frequency_t pwm_getFrequency(void)
+{
+    return pwm_frequencyActive;
+}
+
+// returns non-zero while the 180 deg buck stage is running
+uint8_t pwm_180deg_isEnabled(void)
+{
+    return TCCR2B != 0;
+}
+
+// length of a PWM period of the active frequency setting [CPU cycles]
+uint16_t pwm_getPeriod(void)
+{
+    uint16_t period = (uint16_t)pwm_getTop() + 1;
+
+    return (pwm_frequencyActive == pwm_frequencyMinimal) ? period * 64 : period;
+}
+
+// TOP of the active frequency setting: 127 at 125 kHz, 255 otherwise
+uint8_t pwm_getTop(void)
+{
+    return (pwm_frequencyActive == pwm_frequencyHigh) ? PWM_HIGH_F_TOP : PWM_MEDIUM_F_TOP;
+}
+
+/*
+ * switch the running buck stages to another frequency setting without shutting them down. The duty cycle keeps its
+ * ratio and is rescaled between the 7 bit and 8 bit TOP values, in minimal frequency mode it is set to pwm_max.
+ * Medium and high frequency both count the CPU clock: OCRxA and OCRxB are double buffered and are taken over at
+ * BOTTOM, so both timers finish their running period undisturbed. After that timer 2 is moved to half of the new
+ * period behind timer 0, otherwise the stages would end up 90 deg apart or in phase. Switching to or from minimal
+ * frequency changes the timer clock, here both timers are restarted in phase, which shortens one period.
+ * Does nothing while the buck stages are off, pwm_0deg_enable() selects the frequency then.
+ */
+void pwm_setFrequency(pwm_frequency_t pwm_frequency)
+{
+    uint16_t top, topOld, value, phase;
+    uint8_t stage180, clock0, clock2;
+
+    if (pwm_frequency == pwm_frequencyActive || TCCR0B == 0)
+        return;
+
+    topOld = pwm_getTop();
+    value = pwm_getFine();
+
+    switch (pwm_frequency) {
+    	case pwm_frequencyMinimal:
+    	case pwm_frequencyMedium:
+    	    top = PWM_MEDIUM_F_TOP;
+    	    pwm_min = PWM_MEDIUM_F_MIN;
+    	    pwm_max = PWM_MEDIUM_F_MAX;
+    	    break;
+
+    	case pwm_frequencyHigh:
+    	default:
+    	    top = PWM_HIGH_F_TOP;
+    	    pwm_min = PWM_HIGH_F_MIN;
+    	    pwm_max = PWM_HIGH_F_MAX;
+    	    break;
+    }
+
+    if (pwm_frequency == pwm_frequencyMinimal)
+    {
+        value = PWM_FINE(pwm_max);
+        clock0 = timer0_ClockSelect_div64;
+        clock2 = timer2_ClockSelect_div64;
+    }
+    else
+    {
+        value = (uint32_t)value * (top + 1) / (topOld + 1);
+        clock0 = timer0_ClockSelect_1;
+        clock2 = timer2_ClockSelect_1;
+    }
+
+    //do not interrupt this! -> disable interrupts
+    cli();
+
+    stage180 = pwm_180deg_isEnabled();
+    // the new TOP and duty cycle, both double buffered
+    OCR0A = top;
+    if (stage180)
+        OCR2A = top;
+    pwm_frequencyActive = pwm_frequency;
+    pwm_setFine(value);
+
+    if (clock0 != (TCCR0B & ((1 << CS02) | (1 << CS01) | (1 << CS00))))
+    {
+        // new timer clock: stop all timers and restart both PWMs at BOTTOM, timer 2 half a period later
+        GTCCR = (1<<TSM)|(1<<PSRASY)|(1<<PSRSYNC);
+        TCNT0 = 0;
+        TCCR0B = timer0_ForceOutputCompare_none
+               | timer0_WaveformGenerationModeB_pwmFastOcr
+               | clock0;
+        if (stage180)
+        {
+            TCNT2 = (top + 1) >> 1;
+            TCCR2B = timer2_ForceOutputCompare_none
+                   | timer2_WaveformGenerationModeB_pwmFastOcr
+                   | clock2;
+        }
+        GTCCR = 0;
+    }
+    else if (stage180)
+    {
+        // wait until both timers have passed TOP and loaded the new values, at most one period (256 CPU cycles)
+        TIFR0 = 1 << TOV0;
+        TIFR2 = 1 << TOV2;
+        while (!(TIFR0 & (1 << TOV0)) || !(TIFR2 & (1 << TOV2)))
+            ;
+        // move timer 2 half of the new period behind timer 0 while all timers are stopped
+        GTCCR = (1<<TSM)|(1<<PSRASY)|(1<<PSRSYNC);
+        phase = TCNT0 + ((top + 1) >> 1);
+        if (phase > top)
+            phase -= top + 1;
+        TCNT2 = phase;
+        GTCCR = 0;
+    }
+
+    //enable interrupts
+    sei();
+}
+
 /*
  * this function stops the 0�-phase buck stage attached to timer 0�s OC0B pwm output on pin PD5.
  */
@@ -137,6 +360,8 @@ void pwm_0deg_enable(pwm_frequency_t pwm_frequency)
 	//do not interrupt this! -> disable interrupts
     cli();
 
+    pwm_frequencyActive = pwm_frequency;
+
     // TCCR0A – Timer/Counter Control Register A
     TCCR0A = timer0_CompareMatchOutputAMode_normal
            | timer0_CompareMatchOutputBMode_clear // use OC0B for unshifted shifted pwm
@@ -198,19 +423,15 @@ void pwm_0deg_enable(pwm_frequency_t pwm_frequency)
  */
 void pwm_180deg_enable(pwm_frequency_t pwm_frequency)
 {
-	// we want to shortly stop timer 0 and restart it in sync with timer 2. Therefore, we
-	// use a temporary storage for timer0's control register B.
-	uint16_t timer0_controlregisterB;
+	// TOP of both timers, timer 2 is started half a period after timer 0
+	uint16_t top;
+	uint16_t phase;
 
 	//do not interrupt this! -> disable interrupts
     cli();
 
-    // store setup of timer 0
-    timer0_controlregisterB = TCCR0B;
-    // stop timer 0 temporarily
-    TCCR0B = 0;
-
-    //reset the prescalers and keep both prescalers (and thus all timers) stopped
+    //reset the prescalers and keep both prescalers (and thus all timers) stopped. Timer 0 keeps its count, so the
+    //0 deg stage continues its current period without a glitch when the 180 deg stage is brought in while charging.
     GTCCR = (1<<TSM)|(1<<PSRASY)|(1<<PSRSYNC);
 
     // TCCR2A – Timer/Counter Control Register A
@@ -226,10 +447,7 @@ void pwm_180deg_enable(pwm_frequency_t pwm_frequency)
     	    //set pwm value limits
     	    pwm_min = PWM_MEDIUM_F_MIN;
     	    pwm_max = PWM_MEDIUM_F_MAX;
-    	    // Timer2 shall run 180 deg phase shifted in relation to timer0. Since timer 0
-    	    // may run with 7 bit or 8 bit resolution depending on timer clock frequency,
-    	    // we use half of the timer 2 TOP value from OCR2A to initialize timer 2.
-    	    TCNT2 = (PWM_MEDIUM_F_TOP >> 1);
+    	    top = PWM_MEDIUM_F_TOP;
     	    break;
 
     	case pwm_frequencyHigh:
@@ -239,13 +457,18 @@ void pwm_180deg_enable(pwm_frequency_t pwm_frequency)
     	    // set pwm value limits
     	    pwm_min = PWM_HIGH_F_MIN;
     	    pwm_max = PWM_HIGH_F_MAX;
-    	    // Timer2 shall run 180 deg phase shifted in relation to timer0. Since timer 0
-    	    // may run with 7 bit or 8 bit resolution depending on timer clock frequency,
-    	    // we use half of the timer 2 TOP value from OCR2A to initialize timer 2.
-    	    TCNT2 = (PWM_HIGH_F_TOP >> 1);
+    	    top = PWM_HIGH_F_TOP;
     	    break;
     }
 
+    // Timer2 shall run 180 deg phase shifted in relation to timer0. Since timer 0
+    // may run with 7 bit or 8 bit resolution depending on timer clock frequency,
+    // we add half of the period to the (halted) count of timer 0 and wrap at TOP.
+    phase = TCNT0 + ((top + 1) >> 1);
+    if (phase > top)
+        phase -= top + 1;
+    TCNT2 = phase;
+
     switch (pwm_frequency) {
     	case pwm_frequencyMinimal:
 			// TCCR2B – Timer/Counter Control Register B
@@ -263,9 +486,6 @@ void pwm_180deg_enable(pwm_frequency_t pwm_frequency)
 				   | timer2_ClockSelect_1;
 		break;
     };
-    //restart timer 0
-    TCCR0B = timer0_controlregisterB;
-
     // restart all timers by re-enabling their prescalers
     GTCCR = 0;
 
@@ -9,11 +9,24 @@
 #include <avr/wdt.h>
 #include <avr/sleep.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include "adc.h"
 #include "pwr_management.h"
 #include "datetime.h"
+#include "scheduler.h"
+#include "pwm.h"
+#include "uart.h"
+#include "SoftI2CLib/i2csoft.h"
+#include "ST7032-master/ST7032.h"
+
+static uint32_t idleCycles = 0;     // [CPU cycles] asleep since the last evaluation
+static uint16_t idleWindowTick = 0; // [ms] start of the evaluation window
+static uint8_t idlePercent = 0;     // [%] result of the last evaluation
+static uint8_t clockShift = 0;      // CPU clock is F_CPU >> clockShift
+static uint8_t sleepDarkCount = 0;  // consecutive dark wake-ups
+static volatile uint8_t sleepCycles;    // watchdog cycles left in the present sleep
 
 /*
  * pwr_management.c
@@ -45,13 +58,32 @@ void PTC_ADCref_off(void){
 	PTC_ADCREF_PORT &= ~(1 << PTC_ADCREF);
 }
 
-void goToSleep (void){
-	//disable anything that uselessly burns power during sleep
+void goToSleep (uint8_t dark){
+	uint8_t cycles = 1;
+	uint8_t doublings;
+
+	//stretch the sleep period while it stays dark
+	if (!dark)
+		sleepDarkCount = 0;
+	else if (sleepDarkCount < 0xFF)
+		sleepDarkCount++;
+	for (doublings = sleepDarkCount / SLEEP_DARK_WAKEUPS; doublings && cycles < SLEEP_WDT_CYCLES_MAX; doublings--)
+		cycles <<= 1;
+	sleepCycles = cycles;
 
-	//disable the ADC
+	//disable anything that uselessly burns power during sleep
+	//let the background scan stop and disable the ADC
+	adc_scanStop();
 	adc_disable();
+#ifdef SLEEP_COMPARATOR_WAKE
+	//the comparator uses the ADC multiplexer, keep the ADC powered (but disabled)
+	analog_comparator_enableWake(SLEEP_COMPARATOR_CHANNEL);
+	//no wake-ups by the time base
+	TIMSK1 &= ~(1 << OCIE1A);
+#else
 	//power down the ADC
 	PRR |= (1<<PRADC);
+#endif
 
 	//GPIO
 	//turn off power to the PTC temperature sensors
@@ -63,36 +95,66 @@ void goToSleep (void){
 	wdt_reset();
 	// tell MCU that we legitimately want to change the watchdog configuration
 	WDTCSR = (1<<WDCE) | (1<<WDE);
-	//activate watchdog as interrupt source that triggers WDT ISR in 8 seconds.
+	//activate watchdog as interrupt source that triggers WDT ISR every 8 seconds.
 	WDTCSR = (1<<WDIE) | (1<<WDP3) | (1<<WDP0);
 
+#ifdef SLEEP_COMPARATOR_WAKE
+	//only idle mode is woken by the analog comparator: run it from the slowest clock
+	clock_prescale_set(clock_div_256);
+	set_sleep_mode(SLEEP_MODE_IDLE);
+#else
 	//select power down sleep mode. This sleep mode stops main clock, timers, MCU,..
 	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+#endif
 
-	//enable interrupts
+	//the WDT ISR counts the cycles down, sleep again until all are done
+	while (sleepCycles
+#ifdef SLEEP_COMPARATOR_WAKE
+		   && !analog_comparator_isTriggered()
+#endif
+		  ){
+		sleep_enable();
+#ifndef SLEEP_COMPARATOR_WAKE
+		//deactivate brown-out detector, the CPU has to sleep within 3 cycles
+		sleep_bod_disable();
+#endif
+		//enable interrupts, the next instruction is executed before any ISR
+		sei();
+		//go to sleep.
+		sleep_cpu();
+		sleep_disable();
+		cli();
+	}
 	sei();
-	//deactivate brown-out detector
-	MCUCR = (1<<BODSE) | (1<<BODS);
-	MCUCR = (1<<BODS);
-	//go to sleep.
-	sleep_mode();
-
 	//disable the watchdog to prevent unwanted watchdog interrupts.
 	wdt_disable();
 
+#ifdef SLEEP_COMPARATOR_WAKE
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		clock_prescale_set(clockShift ? CLOCK_SLOW_DIV : clock_div_1);
+	}
+	analog_comparator_disable();
+	TIFR1 = 1 << OCF1A;
+	TIMSK1 |= 1 << OCIE1A;
+#endif
+
 	//restore power to the PTC temperature sensors and the external ADC reference voltage source
 	PTC_ADCref_on();
 
-	//wait 2ms for reference and PTC temperature sensor signals to stabilize
-	_delay_us(2500);
+	//wait 2.5ms for reference and PTC temperature sensor signals to stabilize. _delay_us() would assume F_CPU, the
+	//loop count (4 CPU cycles each) follows the clock.
+	_delay_loop_2((F_CPU / 4000000UL * 2500) >> clockShift);
 
 	//power up the ADC
-	PRR &= !(1<<PRADC);
+	PRR &= ~(1<<PRADC);
 	//initialize ADC
-    adc_init(adc_voltageReferenceAref, adc_adjustResultRight, adc_interruptDisabled, adc_autoTriggerDisabled,\
-    		 adc_autoTriggerSourceFreeRunning);
-	//re-activate ADC
+    adc_init(adc_voltageReferenceAref, adc_adjustResultRight, adc_interruptEnabled, adc_autoTriggerEnabled,\
+    		 adc_autoTriggerSourceTimer1CompareB);
+	//re-activate ADC and restart the background scan
     adc_enable();
+    adc_scanStart();
+    //complete one scan round before returning, in ADC noise reduction sleep if ADC_NOISE_REDUCTION is defined
+    adc_scanWait();
 }
 
 ISR(WDT_vect) {
@@ -100,6 +162,101 @@ wdt_reset(); // reset watchdog counter
 //WDTCSR |= (1<<WDIE); // reenable interrupt to prevent system reset
 // update second clock by 8s.
 datetime_set(datetime_getS()+8);
+// one more cycle of the chained sleep done
+if (sleepCycles)
+	sleepCycles--;
+}
+
+void goToIdle(void){
+	uint16_t before, after;
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	//a task released between the check and sleep_cpu() would wait a whole tick: check with interrupts disabled.
+	//sei() executes the next instruction before any interrupt, so no wake-up gets lost.
+	cli();
+	if (scheduler_isPending()){
+		sei();
+		return;
+	}
+	before = TCNT1;
+	//interrupts that release no task (PWM dither, ADC, UART) send the CPU back to sleep without a main loop pass
+	do {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		cli();
+	} while (!scheduler_isPending());
+	sei();
+	after = TCNT1;
+	//timer1 wraps at OCR1A, the time base interrupt releases the measurement task and ends the sleep at the latest
+	if (after < before)
+		after += OCR1A + 1;
+	after -= before;
+	//the dither interrupt runs once per PWM period while asleep, that time was not idle
+	if (pwm_isDithering())
+		after -= (uint32_t)after * PWM_DITHER_ISR_CYCLES / pwm_getPeriod();
+	idleCycles += after;
+}
+
+//start a new evaluation window, e.g. because the cycles of the old one were counted at another CPU clock
+static void idle_restartWindow(void){
+	idleCycles = 0;
+	idleWindowTick = datetime_getTick();
+}
+
+uint8_t getIdlePercent(void){
+	uint16_t tick = datetime_getTick();
+	uint16_t elapsed = tick - idleWindowTick;
+	uint32_t percent;
+
+	if (elapsed){
+		// cycles per ms and percent: F_CPU / 1000 / 100
+		percent = idleCycles / ((uint32_t)elapsed * ((F_CPU / 100000UL) >> clockShift));
+		idlePercent = (percent > 100) ? 100 : percent;
+		idleCycles = 0;
+		idleWindowTick = tick;
+	}
+	return idlePercent;
+}
+
+uint16_t getIdleSavedCurrent(void){
+	return (uint32_t)idlePercent * (IDLE_ACTIVE_CURRENT_UA - IDLE_IDLE_CURRENT_UA) / 100;
+}
+
+void clock_slow(void){
+	if (clockShift == CLOCK_SLOW_SHIFT)
+		return;
+	//the baud rate does not fit the slow clock: send what is buffered first, including the last byte in the shift
+	//register
+	uart_flush();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		clock_prescale_set(CLOCK_SLOW_DIV);
+		datetime_setClockShift(CLOCK_SLOW_SHIFT);
+	}
+	adc_setPrescaler(ADC_PRESCALER_SLOW_REG);
+	SoftI2CSetClockShift(CLOCK_SLOW_SHIFT);
+	ST7032SetClockShift(CLOCK_SLOW_SHIFT);
+	clockShift = CLOCK_SLOW_SHIFT;
+	idle_restartWindow();
+}
+
+void clock_fast(void){
+	if (clockShift == 0)
+		return;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		clock_prescale_set(clock_div_1);
+		datetime_setClockShift(0);
+	}
+	adc_setPrescaler(ADC_PRESCALER_REG);
+	SoftI2CSetClockShift(0);
+	ST7032SetClockShift(0);
+	clockShift = 0;
+	idle_restartWindow();
+}
+
+uint8_t clock_getShift(void){
+	return clockShift;
 }
 
 void power_twi_spi_usart_disable(void){
@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: 2023 2023 Dipl.-Ing. Jochen Menzel (Jehdar@gmx.de)
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdint.h>
+#include "regulator.h"
+#include "charger.h"
+#include "pwm.h"
+
+static uint8_t regulator_active = 0;
+static int32_t regulator_integrator;        // [fine pwm steps / 256]
+static uint8_t regulator_releaseCount;      // consecutive updates with the setpoint out of reach
+static pwm_frequency_t regulator_frequency; // frequency setting the integrator belongs to
+static uint16_t regulator_held;             // [fine pwm steps] last duty cycle with the setpoint within the margin
+
+
+// (re)start the integrator at the present duty cycle
+static void regulator_seed(void)
+{
+    regulator_integrator = (int32_t)pwm_getFine() << 8;
+    regulator_held = pwm_getFine();
+    regulator_frequency = pwm_getFrequency();
+    regulator_releaseCount = 0;
+}
+
+
+void regulator_update(const measurements_t * measurements)
+{
+    int32_t errorVoltage, errorCurrent, error, output, lower, upper;
+
+    // an overtemperature reduces the current below the limits, the tracker steps down then
+    if (isOvertemperature1() || isOvertemperature2())
+    {
+        regulator_active = 0;
+        return;
+    }
+
+    // positive errors: below the limit
+    errorVoltage = (int32_t)charger_read_target_voltage() - measurements->batteryVoltage.v;
+    errorCurrent = ((int32_t)charger_read_target_current() - measurements->chargeCurrent.v) / (1 << REGULATOR_CURRENT_SHIFT);
+    error = (errorVoltage < errorCurrent) ? errorVoltage : errorCurrent;
+
+    if (!regulator_active)
+    {
+        if (error >= 0)
+            return;
+        regulator_active = 1;
+        regulator_seed();
+    }
+    else if (pwm_getFrequency() != regulator_frequency)
+        // the duty cycle was rescaled by a frequency switch
+        regulator_seed();
+
+    lower = (int32_t)PWM_FINE(pwm_getMin()) << 8;
+    upper = (int32_t)PWM_FINE(pwm_getMax()) << 8;
+
+    // anti-windup: integrate only if the output is not saturated in the direction of the error
+    output = regulator_integrator + (int32_t)REGULATOR_KP * error;
+    if (!((output >= upper && error > 0) || (output <= lower && error < 0)))
+    {
+        regulator_integrator += (int32_t)REGULATOR_KI * error;
+        if (regulator_integrator > upper)
+            regulator_integrator = upper;
+        if (regulator_integrator < lower)
+            regulator_integrator = lower;
+        output = regulator_integrator + (int32_t)REGULATOR_KP * error;
+    }
+    if (output > upper)
+        output = upper;
+    if (output < lower)
+        output = lower;
+    // the regulator needs the sub-count resolution to hold the limit without a limit cycle
+    pwm_setDither(1);
+    pwm_setFine(output >> 8);
+
+    // hand back to the tracker when the panel cannot supply the setpoint any more
+    if (error > REGULATOR_RELEASE_MARGIN)
+    {
+        if (output >= upper || ++regulator_releaseCount >= REGULATOR_RELEASE_UPDATES)
+        {
+            regulator_active = 0;
+            pwm_setFine(regulator_held);
+        }
+    }
+    else
+    {
+        regulator_releaseCount = 0;
+        regulator_held = output >> 8;
+    }
+}
+
+
+uint8_t regulator_isActive(void)
+{
+    return regulator_active;
+}
+
+
+void regulator_release(void)
+{
+    regulator_active = 0;
+}
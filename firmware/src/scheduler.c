@@ -0,0 +1,121 @@
+// SPDX-FileCopyrightText: 2023 2023 Dipl.-Ing. Jochen Menzel (Jehdar@gmx.de)
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdint.h>
+#include <util/atomic.h>
+#include "scheduler.h"
+#include "datetime.h"
+
+static const scheduler_task_t *scheduler_tasks = 0;
+static uint8_t scheduler_count = 0;
+
+static volatile uint8_t scheduler_pending = 0;                  // bit n: task n is released
+static volatile uint16_t scheduler_countdown[SCHEDULER_TASKS_MAX]; // [ticks] until the next release
+static volatile uint16_t scheduler_released[SCHEDULER_TASKS_MAX];  // [ms] tick of the last release
+static volatile uint16_t scheduler_overruns[SCHEDULER_TASKS_MAX];
+
+
+void scheduler_init(const scheduler_task_t *tasks, uint8_t count)
+{
+    uint8_t i;
+
+    if (count > SCHEDULER_TASKS_MAX)
+        count = SCHEDULER_TASKS_MAX;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        scheduler_tasks = tasks;
+        scheduler_count = count;
+        scheduler_pending = 0;
+        for (i = 0; i < count; i++)
+        {
+            // the first release happens in the tick phase / TIME_INTERVAL_MS ticks from now
+            scheduler_countdown[i] = tasks[i].phase / TIME_INTERVAL_MS + 1;
+            scheduler_overruns[i] = 0;
+        }
+    }
+}
+
+
+void scheduler_tick(uint16_t tick)
+{
+    uint8_t i, bit;
+
+    for (i = 0, bit = 1; i < scheduler_count; i++, bit <<= 1)
+    {
+        if (--scheduler_countdown[i])
+            continue;
+        scheduler_countdown[i] = scheduler_tasks[i].period / TIME_INTERVAL_MS;
+        if (scheduler_pending & bit)
+            // the last release did not run yet
+            scheduler_overruns[i]++;
+        else
+        {
+            scheduler_pending |= bit;
+            scheduler_released[i] = tick;
+        }
+    }
+}
+
+
+uint8_t scheduler_run(void)
+{
+    uint8_t i, bit, pending, ran = 0;
+    uint16_t released;
+
+    for (i = 0, bit = 1; i < scheduler_count; i++, bit <<= 1)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            pending = scheduler_pending & bit;
+            scheduler_pending &= ~bit;
+            released = scheduler_released[i];
+        }
+        if (!pending)
+            continue;
+
+        scheduler_tasks[i].run();
+        ran++;
+
+        if ((uint16_t)(datetime_getTick() - released) > scheduler_tasks[i].deadline)
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            {
+                scheduler_overruns[i]++;
+            }
+    }
+    return ran;
+}
+
+
+uint8_t scheduler_isPending(void)
+{
+    return scheduler_pending;
+}
+
+
+void scheduler_release(uint8_t index)
+{
+    // datetime_getTick() enables the interrupts again, so read it outside of the atomic block
+    uint16_t tick = datetime_getTick();
+
+    if (index >= scheduler_count)
+        return;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        scheduler_pending |= 1 << index;
+        scheduler_released[index] = tick;
+    }
+}
+
+
+uint16_t scheduler_getOverruns(uint8_t index)
+{
+    uint16_t overruns;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        overruns = scheduler_overruns[index];
+    }
+    return overruns;
+}
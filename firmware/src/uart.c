@@ -17,6 +17,8 @@ uint8_t bufferSend[UART_BUFFER_SEND];
 fifo_t fifoReceive;
 fifo_t fifoSend;
 
+static volatile uint8_t uartSent = 0; // a byte was written to UDR0 since uart_init(), TXC0 is meaningful
+
 
 void uart_init(void)
 {
@@ -43,6 +45,8 @@ void uart_init(void)
     // UBRRnL and UBRRnH – USART Baud Rate Registers
     UBRR0 = UART_UBRR_VAL;
 
+    uartSent = 0;
+
     // flush receive-buffer
     do
     {
@@ -68,12 +72,27 @@ ISR(USART_RX_vect)
 ISR(USART_UDRE_vect)
 {
     if (fifoSend.count)
+    {
         UDR0 = fifo_get(&fifoSend);
+        // clear TXC0 (write one, keep U2X0/MPCM0, write zero to the status bits), it is set again when the shift
+        // register has sent this byte and no other one follows
+        UCSR0A = (UCSR0A & (1 << U2X0 | 1 << MPCM0)) | 1 << TXC0;
+        uartSent = 1;
+    }
     else
         UCSR0B &= ~(1 << UDRIE0);
 }
 
 
+// Wait until all data is sent: first the send buffer, then the byte in the transmit shift register.
+void uart_flush(void)
+{
+    while (UCSR0B & (1 << UDRIE0)) {}
+    if (uartSent && (UCSR0B & (1 << TXEN0)))
+        while (!(UCSR0A & (1 << TXC0))) {}
+}
+
+
 // Read byte from receive buffer.
 // Returns -1 if buffer is empty.
 int16_t uart_getc(void)